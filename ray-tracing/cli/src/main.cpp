@@ -0,0 +1,222 @@
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "ofMain.h"
+#include "rtScene.h"
+#include "rtBenchmark.h"
+#include "tbb/global_control.h"
+
+// Headless batch renderer: builds the demo scene, renders one frame and writes
+// it to disk. Nothing here opens a window or needs a GL context.
+
+static void printUsage()
+{
+    std::cerr << "usage: raytracer-cli [options] [model.obj[@x,y,z] | cloud.xyz[@x,y,z] ...]\n"
+        "  -o, --output FILE   .png, .ppm or .pfm image (default render.png)\n"
+        "  -W, --width N       image width (default 640)\n"
+        "  -H, --height N      image height (default 480)\n"
+        "  -t, --threads N     worker threads, 0 for every core (default 0)\n"
+        "  -s, --spp N         samples per pixel (default 1)\n"
+        "      --sampler NAME  uniform, halton, sobol or blue-noise (default uniform)\n"
+        "      --bvh NAME      sah, linear or sbvh hierarchy builder (default sah)\n"
+        "      --compress      store the meshes with the compressed hierarchy\n"
+        "      --point-radius R  radius of the points of .xyz clouds without one (default 0.01)\n"
+        "      --packets N     trace N x N pixel blocks as ray packets, 4 or 8 (default off)\n"
+        "      --reflections   glossy reflections on the plane and the spheres\n"
+        "      --streams       trace the reflection rays of each tile as one sorted stream\n"
+        "      --wavefront     render stage by stage from ray queues, logging each stage\n"
+        "      --benchmark     log the convergence of every sampler instead of writing an image\n"
+        "      --max-spp N     highest samples per pixel --benchmark goes up to (default 64)\n"
+        "      --benchmark-layouts  log the memory and trace speed of every mesh, compressed or not\n"
+        "      --check-quadrics     compare the cone and cylinder packet kernels with the scalar\n"
+        "                           tests, and a sphere cloud with a loop over its spheres, on\n"
+        "                           random rays, fails if they disagree\n";
+}
+
+static bool hasExtension(const std::string& path, const std::string& ext)
+{
+    return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+static bool writePPM(const ofPixels& pixels, const std::string& path)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    file << "P6\n" << pixels.getWidth() << " " << pixels.getHeight() << "\n255\n";
+    file.write(reinterpret_cast<const char*>(pixels.getData()), pixels.getWidth() * pixels.getHeight() * 3);
+    return static_cast<bool>(file);
+}
+
+static bool writePFM(const ofFloatPixels& pixels, const std::string& path)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file) return false;
+
+    // a negative scale marks little endian data, rows go from the bottom up
+    size_t w = pixels.getWidth(), h = pixels.getHeight();
+    file << "PF\n" << w << " " << h << "\n-1.0\n";
+    for (size_t row = h; row-- > 0;){
+        file.write(reinterpret_cast<const char*>(pixels.getData() + row * w * 3), w * 3 * sizeof(float));
+    }
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char** argv)
+{
+    std::string output = "render.png";
+    int width = 640, height = 480, threads = 0, spp = 1, max_spp = 64, packets = 0;
+    float point_radius = 0.01f;
+    SamplerType sampler = UNIFORM;
+    BVHBuilder builder = BINNED_SAH;
+    bool benchmark = false, benchmark_layouts = false, check_quadrics = false, compress = false, reflections = false, streams = false, wavefront = false;
+    std::vector<std::string> models;
+
+    for (int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if ((arg == "-o" || arg == "--output") && has_value) output = argv[++i];
+        else if ((arg == "-W" || arg == "--width") && has_value) width = std::atoi(argv[++i]);
+        else if ((arg == "-H" || arg == "--height") && has_value) height = std::atoi(argv[++i]);
+        else if ((arg == "-t" || arg == "--threads") && has_value) threads = std::atoi(argv[++i]);
+        else if ((arg == "-s" || arg == "--spp") && has_value) spp = std::atoi(argv[++i]);
+        else if (arg == "--max-spp" && has_value) max_spp = std::atoi(argv[++i]);
+        else if (arg == "--sampler" && has_value){
+            std::string name = argv[++i];
+            bool found = false;
+            for (auto type: {UNIFORM, HALTON, SOBOL, BLUE_NOISE}){
+                if (name == Sampler::getName(type)){
+                    sampler = type;
+                    found = true;
+                }
+            }
+            if (!found){
+                std::cerr << "unknown sampler " << name << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--bvh" && has_value){
+            std::string name = argv[++i];
+            if (name == "sah") builder = BINNED_SAH;
+            else if (name == "linear") builder = LINEAR;
+            else if (name == "sbvh") builder = SPATIAL;
+            else{
+                std::cerr << "unknown hierarchy builder " << name << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--compress") compress = true;
+        else if (arg == "--point-radius" && has_value) point_radius = std::atof(argv[++i]);
+        else if (arg == "--packets" && has_value) packets = std::atoi(argv[++i]);
+        else if (arg == "--reflections") reflections = true;
+        else if (arg == "--streams") streams = true;
+        else if (arg == "--wavefront") wavefront = true;
+        else if (arg == "--benchmark") benchmark = true;
+        else if (arg == "--benchmark-layouts") benchmark_layouts = true;
+        else if (arg == "--check-quadrics") check_quadrics = true;
+        else if (arg == "-h" || arg == "--help"){
+            printUsage();
+            return 0;
+        }
+        else if (arg[0] != '-') models.push_back(arg);
+        else{
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (width <= 0 || height <= 0 || spp <= 0 || max_spp <= 0 || threads < 0 || point_radius <= 0.f || (packets != 0 && packets != 4 && packets != 8)){
+        printUsage();
+        return 1;
+    }
+
+    // caps every TBB parallel loop of the process, the scene builds included
+    std::unique_ptr<tbb::global_control> thread_limit;
+    if (threads > 0){
+        thread_limit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, threads);
+    }
+
+    // needs no scene, the objects are drawn at random
+    if (check_quadrics) return logKernelChecks(checkQuadricKernels()) ? 0 : 1;
+
+    Scene scene(width, height);
+    scene.raytracer->settings.bvh_builder = builder;
+    scene.raytracer->settings.packet_size = packets;
+    scene.raytracer->settings.reflections = reflections;
+    scene.raytracer->settings.ray_streams = streams;
+    scene.raytracer->settings.wavefront = wavefront;
+    // the layout benchmark compresses copies of the float meshes itself
+    scene.compress_meshes = compress && !benchmark_layouts;
+    for (const auto& model: models){
+        // model.obj@x,y,z places the model, the default spot is in front of the camera
+        auto path = model;
+        glm::vec3 position(1, -1, 2);
+        auto at = model.rfind('@');
+        if (at != std::string::npos){
+            path = model.substr(0, at);
+            if (std::sscanf(model.c_str() + at + 1, "%f,%f,%f", &position[0], &position[1], &position[2]) != 3){
+                std::cerr << "bad position in " << model << ", expected x,y,z\n";
+                return 1;
+            }
+        }
+        bool loaded = hasExtension(path, ".xyz") ? scene.loadSphereCloud(path, position, point_radius)
+            : scene.loadObjModels(path, position);
+        if (!loaded){
+            std::cerr << "could not load " << path << "\n";
+            return 1;
+        }
+    }
+
+    auto& raytracer = *scene.raytracer;
+    raytracer.settings.sampler = sampler;
+    raytracer.settings.samples_per_pixel = spp;
+
+    if (benchmark_layouts){
+        for (const auto& mesh: scene.getMeshes()){
+            logLayouts(benchmarkCompression(*mesh));
+        }
+        return 0;
+    }
+
+    if (benchmark){
+        logConvergence(benchmarkSamplers(raytracer, width, height, max_spp));
+        return 0;
+    }
+
+    ofFloatPixels image;
+    image.allocate(width, height, OF_PIXELS_RGB);
+    float time = raytracer.render(image, threads != 1);
+    ofLogNotice("raytracer-cli") << width << "x" << height << ", " << spp << " spp, "
+        << Sampler::getName(sampler) << " sampler: " << time << " s, scene hierarchy built in "
+        << raytracer.getHierarchyBuildTime() << " ms";
+    if (wavefront){
+        const auto* stages = raytracer.getStageStats();
+        for (int s = 0; s < Wavefront::STAGES; s++){
+            ofLogNotice("raytracer-cli") << stages[s].name << ": " << stages[s].rays << " rays in "
+                << stages[s].seconds << " s, " << stages[s].rays / std::max(stages[s].seconds, 1e-9) / 1e6 << " Mrays/s";
+        }
+    }
+
+    bool written = false;
+    if (hasExtension(output, ".pfm")){
+        written = writePFM(image, output);
+    }
+    else{
+        ofPixels pixels;
+        pixels.allocate(width, height, OF_PIXELS_RGB);
+        for (size_t i = 0; i < pixels.size(); i++){
+            pixels[i] = static_cast<unsigned char>(image[i] * 255.f);
+        }
+        written = hasExtension(output, ".ppm") ? writePPM(pixels, output) : ofSaveImage(pixels, output);
+    }
+
+    if (!written){
+        ofLogError("raytracer-cli") << "could not write " << output;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,445 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "rtClasses.h"
+#include "rtRayPacket.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+enum BVHBuilder { BINNED_SAH, LINEAR, SPATIAL };
+
+// Bounding Volume Hierarchy class
+// Built over the bounds of an arbitrary set of primitives with the surface area
+// heuristic. Nodes are stored in a flat array and the two children of an
+// interior node are always adjacent, so a node only keeps the first of them.
+// Large nodes are binned and partitioned in parallel and their subtrees are
+// built as separate TBB tasks. The LINEAR builder instead sorts the primitives
+// along a Morton curve and splits ranges where the codes first differ, which
+// builds much faster for a somewhat slower hierarchy. The SPATIAL builder also
+// considers splitting primitives that straddle a plane into one reference per
+// side, which pays off on meshes with long or uneven triangles; it runs
+// serially and a primitive may then appear in several leaves.
+// Rays do not walk the binary tree: after every build it is collapsed into
+// nodes of 4 (SSE) or 8 (AVX) children whose boxes are tested together, and
+// a refit rewrites the boxes of those along the refitted paths only.
+
+class BVH {
+  public:
+    struct Node {
+        AABB box;
+        unsigned left_first;    // left child for interior nodes, first index for leaves
+        unsigned count;         // number of primitives, 0 for interior nodes
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    // children per node of the collapsed hierarchy, one SIMD register of floats
+#if defined(__AVX__)
+    static const int width = 8;
+#else
+    static const int width = 4;
+#endif
+
+    // collapsed node, the child boxes are stored as a structure of arrays
+    struct alignas(32) WideNode {
+        float bounds[6][width];     // min x, y, z then max x, y, z of every child
+        unsigned child[width];      // wide node of interior children, first index for leaves
+        unsigned count[width];      // number of primitives in leaf children, 0 for interior ones
+        unsigned num_children;
+    };
+
+    struct Stats {
+        unsigned nodes = 0, leaves = 0, max_depth = 0, max_leaf_size = 0;
+        float avg_leaf_size = 0.f, sah_cost = 0.f;
+        size_t references = 0;
+    };
+
+    // bounds of the parts of primitive prim on either side of the plane at
+    // position along axis, clipped to box, the bounds of its current reference
+    typedef std::function<void(unsigned prim, int axis, float position, const AABB& box,
+        AABB& left, AABB& right)> SplitFunction;
+
+    static const int num_bins = 16;
+    static const unsigned max_leaf_size = 8;
+    static const unsigned max_depth = 60;
+    static constexpr float traversal_cost = 1.f;
+    static constexpr float intersection_cost = 1.f;
+    // nodes with fewer primitives are built serially within one task
+    static const unsigned parallel_min_size = 4096;
+    static const unsigned linear_leaf_size = 4;
+    // packets thinner than this carry on as single rays
+    static const int packet_min_rays = 4;
+    // spatial splits stop once there are this many more references than primitives
+    static constexpr float max_reference_growth = 0.3f;
+    // and are only tried where the children of the object split overlap by
+    // more than this fraction of the root area
+    static constexpr float min_spatial_overlap = 1e-5f;
+
+    // split_prim is used by the SPATIAL builder, without it references are
+    // split by clipping their boxes
+    void build(const std::vector<AABB>& prim_bounds, BVHBuilder builder=BINNED_SAH,
+        const SplitFunction& split_prim=nullptr);
+    // Recomputes the boxes above the changed primitives, bottom-up along
+    // their paths to the root, in the binary and the wide nodes. The tree
+    // itself is kept, so its quality degrades as primitives move away from
+    // where they were built. Not for SPATIAL hierarchies, whose references
+    // are clipped to their nodes.
+    void refit(const std::vector<AABB>& prim_bounds, const std::vector<unsigned>& changed);
+    Stats getStats() const;
+    // the SAH cost of getStats, which refit keeps up to date along the paths
+    // it walks instead of going over the whole tree again
+    float getSAHCost() const;
+    bool empty() const { return nodes.empty(); }
+
+    // indices of points sorted along a Morton curve over their bounds, as
+    // the LINEAR builder orders centroids, and the code of each in that order
+    static void mortonSort(const std::vector<glm::vec3>& points, std::vector<unsigned>& order, std::vector<uint64_t>& codes);
+
+    // Visits the leaves pierced by the ray front to back. intersect(index, t_max)
+    // tests one primitive and shrinks t_max on a closer hit, which prunes the
+    // nodes still waiting on the stack.
+    template<typename Intersector>
+    void traverse(const Ray& ray, float& t_max, Intersector&& intersect) const;
+
+    // Any hit query, stops as soon as test(index) reports a primitive
+    // blocking the ray before t_max.
+    template<typename Intersector>
+    bool occluded(const Ray& ray, float t_max, Intersector&& test) const;
+
+    // same walks handing over whole leaves, as the range [first, first + count)
+    // of indices, for primitives stored in the order of the leaves. They can
+    // start from any wide node.
+    template<typename LeafIntersector>
+    void traverseLeaves(const Ray& ray, float& t_max, LeafIntersector&& intersect_leaf, unsigned root=0) const;
+
+    template<typename LeafTester>
+    bool occludedLeaves(const Ray& ray, float t_max, LeafTester&& test_leaf, unsigned root=0) const;
+
+    // Packet walks: a node is fetched once for all the active rays reaching
+    // it, each of them testing its children on its own, and its children are
+    // visited with the rays that entered them. Where fewer than
+    // packet_min_rays are left the subtree is walked ray by ray.
+    // intersect_leaf(first, count, rays, t_max) tests the leaf against rays,
+    // shrinking their entries of t_max on closer hits.
+    template<typename LeafIntersector>
+    void traversePacket(const RayPacket& packet, RayMask active, float* t_max, LeafIntersector&& intersect_leaf) const;
+
+    // test_leaf(first, count, rays) returns the rays the leaf blocks, the
+    // result is the mask of the active rays blocked before their t_max
+    template<typename LeafTester>
+    RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max, LeafTester&& test_leaf) const;
+
+    // slab test against up to width boxes at once, bounds laid out as in WideNode
+    // and 32 byte aligned. Returns the mask of the boxes entered before t_max
+    // and fills in their entry distances.
+    static unsigned intersectChildren(const float (*bounds)[width], unsigned num_children,
+        const glm::vec3& origin, const glm::vec3& inv_dir, float t_max, float* t_near);
+
+    std::vector<Node> nodes;
+    std::vector<WideNode> wide_nodes;
+    std::vector<unsigned> indices;
+
+  private:
+    // parent of every node, leaf of every primitive and slot of every node
+    // in the wide nodes (wide node * width + child), set up by the first refit
+    std::vector<unsigned> parents, prim_leaves, wide_slots;
+    // SAH cost times the root area, summed by the first refit as well
+    double area_cost = 0.0;
+
+    // cost of a node per unit of its area
+    static float sahWeight(const Node& node) { return node.isLeaf() ? intersection_cost * node.count : traversal_cost; }
+
+    struct Split {
+        int axis = -1, bin = 0;
+        float cost = INFINITY, c_min = 0.f, scale = 0.f;
+        AABB left_box, right_box;
+    };
+
+    void linkParents();
+    void collapse();
+    // copies the box of a node into its slot of the wide nodes, if it has one
+    void refitWideSlot(unsigned node_idx);
+    AABB computeBounds(unsigned first, unsigned count, const std::vector<AABB>& prim_bounds) const;
+    unsigned partition(unsigned first, unsigned count, const Split& split,
+        const std::vector<glm::vec3>& centroids);
+    void subdivide(unsigned node_idx, unsigned depth, const std::vector<AABB>& prim_bounds,
+        const std::vector<glm::vec3>& centroids, std::atomic<unsigned>& node_count);
+    void buildLinear(const std::vector<AABB>& prim_bounds, const std::vector<glm::vec3>& centroids);
+    void emitLinear(unsigned node_idx, unsigned first, unsigned count, unsigned depth,
+        const std::vector<AABB>& prim_bounds, const std::vector<uint64_t>& codes, std::atomic<unsigned>& node_count);
+    struct SpatialBuild;
+    void buildSpatial(const std::vector<AABB>& prim_bounds, const SplitFunction& split_prim);
+    void subdivideSpatial(unsigned node_idx, std::vector<unsigned>& refs, unsigned depth, SpatialBuild& build);
+    Split findBestSplit(const Node& node, const std::vector<AABB>& prim_bounds,
+        const std::vector<glm::vec3>& centroids) const;
+};
+
+inline unsigned BVH::intersectChildren(const float (*bounds)[width], unsigned num_children,
+    const glm::vec3& origin, const glm::vec3& inv_dir, float t_max, float* t_near)
+{
+    // the operand order of every min and max matches AABB::intersect, so the
+    // NaN of a 0 * inf lane is dropped the same way
+    unsigned valid = (1u << num_children) - 1;
+#if defined(__AVX__)
+    __m256 t_min = _mm256_setzero_ps(), t_far = _mm256_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++){
+        __m256 o = _mm256_set1_ps(origin[axis]), inv = _mm256_set1_ps(inv_dir[axis]);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[axis]), o), inv);
+        __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[axis + 3]), o), inv);
+        t_min = _mm256_max_ps(_mm256_min_ps(t2, t1), t_min);
+        t_far = _mm256_min_ps(_mm256_max_ps(t2, t1), t_far);
+    }
+    _mm256_store_ps(t_near, t_min);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t_min, t_far, _CMP_LE_OQ)) & valid;
+#elif defined(__SSE__) || defined(_M_X64)
+    __m128 t_min = _mm_setzero_ps(), t_far = _mm_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++){
+        __m128 o = _mm_set1_ps(origin[axis]), inv = _mm_set1_ps(inv_dir[axis]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[axis]), o), inv);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[axis + 3]), o), inv);
+        t_min = _mm_max_ps(_mm_min_ps(t2, t1), t_min);
+        t_far = _mm_min_ps(_mm_max_ps(t2, t1), t_far);
+    }
+    _mm_store_ps(t_near, t_min);
+    return _mm_movemask_ps(_mm_cmple_ps(t_min, t_far)) & valid;
+#else
+    unsigned mask = 0;
+    for (int c = 0; c < width; c++){
+        float t_min = 0.f, t_far = t_max;
+        for (int axis = 0; axis < 3; axis++){
+            float t1 = (bounds[axis][c] - origin[axis]) * inv_dir[axis];
+            float t2 = (bounds[axis + 3][c] - origin[axis]) * inv_dir[axis];
+            t_min = std::max(t_min, std::min(t1, t2));
+            t_far = std::min(t_far, std::max(t1, t2));
+        }
+        t_near[c] = t_min;
+        if (t_min <= t_far) mask |= 1u << c;
+    }
+    return mask & valid;
+#endif
+}
+
+template<typename LeafIntersector>
+void BVH::traverseLeaves(const Ray& ray, float& t_max, LeafIntersector&& intersect_leaf, unsigned root) const
+{
+    if (wide_nodes.empty()) return;
+
+    auto inv_dir = glm::vec3(1.f/ray.d[0], 1.f/ray.d[1], 1.f/ray.d[2]);
+    // leaves go on the stack like nodes, so they are also visited by distance
+    struct Entry { unsigned child, count; float t; };
+    Entry stack[(width - 1) * max_depth + width];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = {root, 0, 0.f};
+    alignas(32) float t_near[width];
+
+    while (stack_ptr > 0){
+        auto entry = stack[--stack_ptr];
+        // a closer hit has been found since this node was pushed
+        if (entry.t > t_max) continue;
+
+        if (entry.count > 0){
+            intersect_leaf(entry.child, entry.count, t_max);
+            continue;
+        }
+
+        const WideNode& node = wide_nodes[entry.child];
+        unsigned mask = intersectChildren(node.bounds, node.num_children, ray.o, inv_dir, t_max, t_near);
+
+        // insertion sort of the children hit, the nearest one ends up on top
+        int bottom = stack_ptr;
+        for (; mask; mask &= mask - 1){
+            int c = __builtin_ctz(mask);
+            Entry child = {node.child[c], node.count[c], t_near[c]};
+            int k = stack_ptr++;
+            while (k > bottom && stack[k - 1].t < child.t){
+                stack[k] = stack[k - 1];
+                k--;
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+template<typename Intersector>
+void BVH::traverse(const Ray& ray, float& t_max, Intersector&& intersect) const
+{
+    traverseLeaves(ray, t_max, [&](unsigned first, unsigned count, float& t_max){
+        for (unsigned i = first; i < first + count; i++) intersect(indices[i], t_max);
+    });
+}
+
+template<typename LeafTester>
+bool BVH::occludedLeaves(const Ray& ray, float t_max, LeafTester&& test_leaf, unsigned root) const
+{
+    if (wide_nodes.empty()) return false;
+
+    auto inv_dir = glm::vec3(1.f/ray.d[0], 1.f/ray.d[1], 1.f/ray.d[2]);
+    unsigned stack[(width - 1) * max_depth + width];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = root;
+    alignas(32) float t_near[width];
+
+    // any blocker ends the query, so there is nothing to gain from ordering the children
+    while (stack_ptr > 0){
+        const WideNode& node = wide_nodes[stack[--stack_ptr]];
+        unsigned mask = intersectChildren(node.bounds, node.num_children, ray.o, inv_dir, t_max, t_near);
+
+        for (; mask; mask &= mask - 1){
+            int c = __builtin_ctz(mask);
+            if (node.count[c] == 0){
+                stack[stack_ptr++] = node.child[c];
+                continue;
+            }
+            if (test_leaf(node.child[c], node.count[c])) return true;
+        }
+    }
+
+    return false;
+}
+
+template<typename Intersector>
+bool BVH::occluded(const Ray& ray, float t_max, Intersector&& test) const
+{
+    return occludedLeaves(ray, t_max, [&](unsigned first, unsigned count){
+        for (unsigned i = first; i < first + count; i++){
+            if (test(indices[i])) return true;
+        }
+        return false;
+    });
+}
+
+template<typename LeafIntersector>
+void BVH::traversePacket(const RayPacket& packet, RayMask active, float* t_max, LeafIntersector&& intersect_leaf) const
+{
+    if (wide_nodes.empty() || !active) return;
+
+    glm::vec3 origin[RayPacket::max_size], inv_dir[RayPacket::max_size];
+    for (RayMask rays = active; rays; rays &= rays - 1){
+        int k = __builtin_ctzll(rays);
+        origin[k] = glm::vec3(packet.o[0][k], packet.o[1][k], packet.o[2][k]);
+        inv_dir[k] = glm::vec3(1.f/packet.d[0][k], 1.f/packet.d[1][k], 1.f/packet.d[2][k]);
+    }
+
+    // t is the nearest entry distance over the rays of the entry
+    struct Entry { unsigned child, count; RayMask rays; float t; };
+    Entry stack[(width - 1) * max_depth + width];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = {0, 0, active, 0.f};
+    alignas(32) float t_near[width];
+
+    while (stack_ptr > 0){
+        auto entry = stack[--stack_ptr];
+        // rays that found a hit closer than the entry are done with it
+        RayMask rays = 0;
+        for (RayMask r = entry.rays; r; r &= r - 1){
+            int k = __builtin_ctzll(r);
+            if (t_max[k] >= entry.t) rays |= RayMask(1) << k;
+        }
+        if (!rays) continue;
+
+        if (entry.count > 0){
+            intersect_leaf(entry.child, entry.count, rays, t_max);
+            continue;
+        }
+
+        if (__builtin_popcountll(rays) < packet_min_rays){
+            for (; rays; rays &= rays - 1){
+                int k = __builtin_ctzll(rays);
+                traverseLeaves(packet.ray(k), t_max[k], [&](unsigned first, unsigned count, float&){
+                    intersect_leaf(first, count, RayMask(1) << k, t_max);
+                }, entry.child);
+            }
+            continue;
+        }
+
+        const WideNode& node = wide_nodes[entry.child];
+        RayMask child_rays[width] = {};
+        float child_t[width];
+        for (int c = 0; c < width; c++) child_t[c] = INFINITY;
+        for (RayMask r = rays; r; r &= r - 1){
+            int k = __builtin_ctzll(r);
+            unsigned mask = intersectChildren(node.bounds, node.num_children, origin[k], inv_dir[k], t_max[k], t_near);
+            for (; mask; mask &= mask - 1){
+                int c = __builtin_ctz(mask);
+                child_rays[c] |= RayMask(1) << k;
+                child_t[c] = std::min(child_t[c], t_near[c]);
+            }
+        }
+
+        int bottom = stack_ptr;
+        for (unsigned c = 0; c < node.num_children; c++){
+            if (!child_rays[c]) continue;
+            Entry child = {node.child[c], node.count[c], child_rays[c], child_t[c]};
+            int k = stack_ptr++;
+            while (k > bottom && stack[k - 1].t < child.t){
+                stack[k] = stack[k - 1];
+                k--;
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+template<typename LeafTester>
+RayMask BVH::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max, LeafTester&& test_leaf) const
+{
+    if (wide_nodes.empty() || !active) return 0;
+
+    glm::vec3 origin[RayPacket::max_size], inv_dir[RayPacket::max_size];
+    for (RayMask rays = active; rays; rays &= rays - 1){
+        int k = __builtin_ctzll(rays);
+        origin[k] = glm::vec3(packet.o[0][k], packet.o[1][k], packet.o[2][k]);
+        inv_dir[k] = glm::vec3(1.f/packet.d[0][k], 1.f/packet.d[1][k], 1.f/packet.d[2][k]);
+    }
+
+    struct Entry { unsigned node; RayMask rays; };
+    Entry stack[(width - 1) * max_depth + width];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = {0, active};
+    alignas(32) float t_near[width];
+    RayMask blocked = 0;
+
+    while (stack_ptr > 0 && blocked != active){
+        auto entry = stack[--stack_ptr];
+        RayMask rays = entry.rays & ~blocked;
+        if (!rays) continue;
+
+        if (__builtin_popcountll(rays) < packet_min_rays){
+            for (; rays; rays &= rays - 1){
+                int k = __builtin_ctzll(rays);
+                RayMask ray = RayMask(1) << k;
+                if (occludedLeaves(packet.ray(k), t_max[k], [&](unsigned first, unsigned count){
+                    return (test_leaf(first, count, ray) & ray) != 0;
+                }, entry.node)) blocked |= ray;
+            }
+            continue;
+        }
+
+        const WideNode& node = wide_nodes[entry.node];
+        RayMask child_rays[width] = {};
+        for (RayMask r = rays; r; r &= r - 1){
+            int k = __builtin_ctzll(r);
+            unsigned mask = intersectChildren(node.bounds, node.num_children, origin[k], inv_dir[k], t_max[k], t_near);
+            for (; mask; mask &= mask - 1) child_rays[__builtin_ctz(mask)] |= RayMask(1) << k;
+        }
+
+        for (unsigned c = 0; c < node.num_children; c++){
+            RayMask child = child_rays[c] & ~blocked;
+            if (!child) continue;
+            if (node.count[c] == 0){
+                stack[stack_ptr++] = {node.child[c], child};
+                continue;
+            }
+            blocked |= test_leaf(node.child[c], node.count[c], child) & child;
+        }
+    }
+
+    return blocked;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include "rtRayTracer.h"
+
+struct ConvergenceSample {
+    SamplerType sampler;
+    int samples_per_pixel;
+    float rmse;         // against the reference, in 8 bit color levels
+    float render_time;  // seconds
+};
+
+// Renders a reference image with reference_spp uniform samples per pixel, then
+// every sampler at power of two sample counts up to max_spp, and measures the
+// RMSE of each image against the reference. The render settings of the
+// raytracer are restored afterwards.
+std::vector<ConvergenceSample> benchmarkSamplers(RayTracer& raytracer, int width, int height,
+    int max_spp = 64, int reference_spp = 1024, bool parallel = true);
+
+void logConvergence(const std::vector<ConvergenceSample>& results);
+
+struct LayoutSample {
+    const char* layout;
+    float bytes_per_triangle;   // hierarchy and triangles, see Model::memoryUsage
+    float mrays_per_second;
+    int hits;
+};
+
+// Traces the same random rays through a mesh in its float layout and through
+// a compressed copy of it, one thread, closest hits only.
+std::vector<LayoutSample> benchmarkCompression(const Model& model, int num_rays = 1 << 20);
+
+void logLayouts(const std::vector<LayoutSample>& results);
+
+struct KernelCheck {
+    const char* primitive;
+    int rays, hits;
+    int mismatches;         // rays whose closest hit is another object, or none, for one of the two
+    float max_error;        // largest difference of the distances to the same object, relative to them
+    float scalar_mrays_per_second, batched_mrays_per_second;
+};
+
+// Tests random rays against cones and cylinders, once ray by ray with their
+// intersect and once in packets through the batched kernels, one thread, and
+// compares the hits. A SphereCloud is also checked against a loop over the
+// same spheres.
+std::vector<KernelCheck> checkQuadricKernels(int num_rays = 1 << 20);
+
+// logs the results, returns whether both agree everywhere
+bool logKernelChecks(const std::vector<KernelCheck>& results);
@@ -1,7 +1,6 @@
 #pragma once 
 
 #include "ofMain.h"
-#include "rtPrimitives.h"
 #include "rtLinearAlgebra.h"
 
 class Primitive;
@@ -46,6 +45,7 @@ class HitRecord {
     glm::vec3 p, n;
     const Primitive* obj;
     Ray ray;
+    unsigned prim = 0;      // as in Intersection, for the objects made of many
 
     HitRecord(): hit(false), t(-1.0), p(0,0,0), n(0,0,0), ray(p,n) {};
     HitRecord(bool hit, float d, const glm::vec3& hit_point,
@@ -56,3 +56,148 @@ class HitRecord {
         }
 };
 
+// Intersection Class
+// the compact record carried through traversal, the hit point and
+// normal are only evaluated for the final closest hit
+struct Intersection {
+    float t = INFINITY;
+    float u = 0.f, v = 0.f;     // barycentric coordinates on triangles
+    unsigned prim = 0;          // triangle index within a mesh, sphere within a cloud
+    const Primitive* obj = nullptr;
+};
+
+// Axis Aligned Bounding Box
+struct AABB {
+    glm::vec3 min, max;
+
+    AABB(): min(INFINITY, INFINITY, INFINITY), max(-INFINITY, -INFINITY, -INFINITY) {};
+    AABB(const glm::vec3& v1, const glm::vec3& v2): min(v1), max(v2) {};
+
+    void grow(const glm::vec3& p) {
+        for (int i = 0; i < 3; i++){
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+
+    void grow(const AABB& box) {
+        for (int i = 0; i < 3; i++){
+            min[i] = std::min(min[i], box.min[i]);
+            max[i] = std::max(max[i], box.max[i]);
+        }
+    }
+
+    // part of this box inside box, empty if they do not overlap
+    AABB clip(const AABB& box) const {
+        AABB ret;
+        for (int i = 0; i < 3; i++){
+            ret.min[i] = std::max(min[i], box.min[i]);
+            ret.max[i] = std::min(max[i], box.max[i]);
+            if (ret.min[i] > ret.max[i]) return AABB();
+        }
+        return ret;
+    }
+
+    bool isEmpty() const { return min[0] > max[0] || min[1] > max[1] || min[2] > max[2]; }
+
+    glm::vec3 centroid() const { return scale_vec(0.5f, add_vecs(min, max)); }
+
+    float area() const {
+        if (min[0] > max[0]) return 0.f;
+        auto e = subtract_vecs(max, min);
+        return 2.f * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+    }
+
+    // slab test, inv_dir is the componentwise inverse of ray.d.
+    // t_near is the entry distance clamped to the ray origin
+    bool intersect(const Ray& ray, const glm::vec3& inv_dir, float t_max, float& t_near) const {
+        float t_min = 0.f;
+        for (int i = 0; i < 3; i++){
+            float t1 = (min[i] - ray.o[i]) * inv_dir[i];
+            float t2 = (max[i] - ray.o[i]) * inv_dir[i];
+            t_min = std::max(t_min, std::min(t1, t2));
+            t_max = std::min(t_max, std::max(t1, t2));
+        }
+        t_near = t_min;
+        return t_min <= t_max;
+    }
+};
+
+// Affine Transform
+// the top three rows of a 4x4 matrix whose last row is always (0, 0, 0, 1)
+struct Transform {
+    glm::vec4 rows[3];
+
+    Transform(): rows{glm::vec4(1,0,0,0), glm::vec4(0,1,0,0), glm::vec4(0,0,1,0)} {};
+    // from the column major matrices of rtTransformation.h
+    explicit Transform(const glm::mat4& m) {
+        for (int r = 0; r < 3; r++) rows[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+    }
+
+    glm::vec3 vector(const glm::vec3& v) const {
+        glm::vec3 r;
+        for (int i = 0; i < 3; i++) r[i] = rows[i][0] * v[0] + rows[i][1] * v[1] + rows[i][2] * v[2];
+        return r;
+    }
+
+    glm::vec3 point(const glm::vec3& p) const {
+        auto r = vector(p);
+        for (int i = 0; i < 3; i++) r[i] += rows[i][3];
+        return r;
+    }
+
+    // transposed linear part, called on the inverse transform it carries normals along
+    glm::vec3 normal(const glm::vec3& n) const {
+        glm::vec3 r;
+        for (int i = 0; i < 3; i++) r[i] = rows[0][i] * n[0] + rows[1][i] * n[1] + rows[2][i] * n[2];
+        return r;
+    }
+
+    // the transform applying t first and this one after it
+    Transform operator*(const Transform& t) const {
+        Transform m;
+        for (int i = 0; i < 3; i++){
+            for (int j = 0; j < 4; j++){
+                m.rows[i][j] = rows[i][0] * t.rows[0][j] + rows[i][1] * t.rows[1][j] + rows[i][2] * t.rows[2][j];
+            }
+            m.rows[i][3] += rows[i][3];
+        }
+        return m;
+    }
+
+    Transform inverse() const {
+        // adjugate of the linear part over its determinant, then the translation undone
+        const auto& a = rows;
+        glm::vec3 c0(a[1][1] * a[2][2] - a[1][2] * a[2][1], a[1][2] * a[2][0] - a[1][0] * a[2][2], a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        float inv_det = 1.f / (a[0][0] * c0[0] + a[0][1] * c0[1] + a[0][2] * c0[2]);
+
+        Transform m;
+        m.rows[0] = glm::vec4(c0[0], a[0][2] * a[2][1] - a[0][1] * a[2][2], a[0][1] * a[1][2] - a[0][2] * a[1][1], 0.f);
+        m.rows[1] = glm::vec4(c0[1], a[0][0] * a[2][2] - a[0][2] * a[2][0], a[0][2] * a[1][0] - a[0][0] * a[1][2], 0.f);
+        m.rows[2] = glm::vec4(c0[2], a[0][1] * a[2][0] - a[0][0] * a[2][1], a[0][0] * a[1][1] - a[0][1] * a[1][0], 0.f);
+        for (int i = 0; i < 3; i++){
+            m.rows[i] = scale_vec(inv_det, m.rows[i]);
+        }
+
+        auto t = m.vector(glm::vec3(a[0][3], a[1][3], a[2][3]));
+        for (int i = 0; i < 3; i++) m.rows[i][3] = -t[i];
+        return m;
+    }
+
+    // smallest box around the transformed one, ref: Arvo, "Transforming Axis-Aligned Bounding Boxes", 1990
+    AABB apply(const AABB& box) const {
+        if (box.min[0] > box.max[0]) return box;
+
+        AABB r;
+        for (int i = 0; i < 3; i++){
+            r.min[i] = r.max[i] = rows[i][3];
+            for (int j = 0; j < 3; j++){
+                float e = rows[i][j] * box.min[j];
+                float f = rows[i][j] * box.max[j];
+                r.min[i] += std::min(e, f);
+                r.max[i] += std::max(e, f);
+            }
+        }
+        return r;
+    }
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "rtClasses.h"
+#include "rtBVH.h"
+
+// Compressed mesh hierarchy
+// Same tree as the wide nodes of a BVH, stored at a fraction of the memory.
+// Child boxes are 8 bit offsets on a power of two grid spanning their node,
+// interior children sit next to each other so a node only keeps the first,
+// and the triangles of all leaf children of a node form one block with its
+// vertices quantized to 16 bits over the bounds of the mesh. Boxes and
+// vertices are decoded on the fly during traversal. Shared vertices land on
+// the same grid point, so the quantized mesh stays watertight.
+// ref: Ylitie et al., "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs", 2017
+
+class CompressedBVH {
+  public:
+    static const int width = BVH::width;
+
+    struct Node {
+        glm::vec3 origin;               // min corner of the node, the grid starts here
+        int8_t exponent[3];             // grid spacing as a power of two per axis
+        uint8_t num_children;
+        uint32_t child_base;            // node of the first interior child
+        uint32_t triangle_base;         // first triangle of the first leaf child
+        uint8_t count[width];           // triangles in leaf children, 0 for interior ones
+        uint8_t q_min[3][width], q_max[3][width];
+    };
+
+    struct CompressedTriangle {
+        uint16_t v[3][3];               // vertices on the grid of the mesh bounds
+        uint32_t prim;                  // index of the triangle in the source mesh
+    };
+
+    // fails on leaves holding more triangles than a node can count
+    bool build(const BVH& bvh, const std::vector<Triangle>& triangles, const std::vector<glm::vec3>& vertices);
+    bool empty() const { return nodes.empty(); }
+    size_t memoryUsage() const;
+
+    glm::vec3 vertex(const CompressedTriangle& triangle, int k) const {
+        glm::vec3 p;
+        for (int axis = 0; axis < 3; axis++) p[axis] = mesh_bounds.min[axis] + triangle.v[k][axis] * vertex_scale[axis];
+        return p;
+    }
+
+    // same contract as BVH::traverse, intersect(triangle, t_max) gets the decoded block entry
+    template<typename Intersector>
+    void traverse(const Ray& ray, float& t_max, Intersector&& intersect) const;
+
+    template<typename Intersector>
+    bool occluded(const Ray& ray, float t_max, Intersector&& test) const;
+
+    AABB mesh_bounds;
+    std::vector<Node> nodes;
+    std::vector<CompressedTriangle> blocks;
+
+  private:
+    glm::vec3 vertex_scale;
+
+    // float child boxes and the triangle each leaf child starts at
+    void decode(const Node& node, float (*bounds)[width], uint32_t* first_triangle) const;
+};
+
+inline void CompressedBVH::decode(const Node& node, float (*bounds)[width], uint32_t* first_triangle) const
+{
+    // q * 2^e is exact, so a fused multiply-add decodes to the same box as the build
+    for (int axis = 0; axis < 3; axis++){
+        float scale = std::ldexp(1.f, node.exponent[axis]);
+        for (int c = 0; c < width; c++){
+            bounds[axis][c] = node.origin[axis] + node.q_min[axis][c] * scale;
+            bounds[axis + 3][c] = node.origin[axis] + node.q_max[axis][c] * scale;
+        }
+    }
+
+    uint32_t triangle = node.triangle_base, child = node.child_base;
+    for (int c = 0; c < node.num_children; c++){
+        first_triangle[c] = node.count[c] > 0 ? triangle : child++;
+        triangle += node.count[c];
+    }
+}
+
+template<typename Intersector>
+void CompressedBVH::traverse(const Ray& ray, float& t_max, Intersector&& intersect) const
+{
+    if (nodes.empty()) return;
+
+    auto inv_dir = glm::vec3(1.f/ray.d[0], 1.f/ray.d[1], 1.f/ray.d[2]);
+    struct Entry { unsigned child, count; float t; };
+    Entry stack[(width - 1) * BVH::max_depth + width];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = {0, 0, 0.f};
+    alignas(32) float bounds[6][width];
+    alignas(32) float t_near[width];
+    uint32_t first[width];
+
+    while (stack_ptr > 0){
+        auto entry = stack[--stack_ptr];
+        if (entry.t > t_max) continue;
+
+        if (entry.count > 0){
+            for (unsigned i = entry.child; i < entry.child + entry.count; i++){
+                intersect(blocks[i], t_max);
+            }
+            continue;
+        }
+
+        const Node& node = nodes[entry.child];
+        decode(node, bounds, first);
+        unsigned mask = BVH::intersectChildren(bounds, node.num_children, ray.o, inv_dir, t_max, t_near);
+
+        int bottom = stack_ptr;
+        for (; mask; mask &= mask - 1){
+            int c = __builtin_ctz(mask);
+            Entry child = {first[c], node.count[c], t_near[c]};
+            int k = stack_ptr++;
+            while (k > bottom && stack[k - 1].t < child.t){
+                stack[k] = stack[k - 1];
+                k--;
+            }
+            stack[k] = child;
+        }
+    }
+}
+
+template<typename Intersector>
+bool CompressedBVH::occluded(const Ray& ray, float t_max, Intersector&& test) const
+{
+    if (nodes.empty()) return false;
+
+    auto inv_dir = glm::vec3(1.f/ray.d[0], 1.f/ray.d[1], 1.f/ray.d[2]);
+    unsigned stack[(width - 1) * BVH::max_depth + width];
+    int stack_ptr = 0;
+    stack[stack_ptr++] = 0;
+    alignas(32) float bounds[6][width];
+    alignas(32) float t_near[width];
+    uint32_t first[width];
+
+    while (stack_ptr > 0){
+        const Node& node = nodes[stack[--stack_ptr]];
+        decode(node, bounds, first);
+        unsigned mask = BVH::intersectChildren(bounds, node.num_children, ray.o, inv_dir, t_max, t_near);
+
+        for (; mask; mask &= mask - 1){
+            int c = __builtin_ctz(mask);
+            if (node.count[c] == 0){
+                stack[stack_ptr++] = first[c];
+                continue;
+            }
+            for (unsigned i = first[c]; i < first[c] + node.count[c]; i++){
+                if (test(blocks[i])) return true;
+            }
+        }
+    }
+
+    return false;
+}
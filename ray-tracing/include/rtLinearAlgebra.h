@@ -1,9 +1,9 @@
 #pragma once
 
-#include <random>
 #include <cmath>
 #include <algorithm>
 #include "ofMain.h"
+#include "rtSampler.h"
 
 #define EPS 1e-4
 
@@ -100,16 +100,17 @@ static glm::vec3 normalize(const glm::vec3& v)
 	);
 }
 
-static bool solve_quadratic(const float a, const float b, const float c, float & t1, float & t2)
+// in float throughout, the batched kernels of rtQuadrics.cpp repeat it lane by lane
+static inline bool solve_quadratic(const float a, const float b, const float c, float & t1, float & t2)
 {
-    auto discriminant = b*b - 4.0*a*c;
+    float discriminant = b*b - 4.f*a*c;
     
-    if(discriminant < 0.0) return false;
+    if(discriminant < 0.f) return false;
     
-    auto root = sqrt(discriminant);
+    float root = std::sqrt(discriminant);
     
-    t1 = (-b + root) / (2.0 * a);
-    t2 = (-b - root) / (2.0 * a);
+    t1 = (-b + root) / (2.f * a);
+    t2 = (-b - root) / (2.f * a);
 
     return true;
 }
@@ -166,12 +167,11 @@ static glm::vec4 matmul(const glm::mat4& matrix, const glm::vec4& v)
 
 static glm::vec3 random_unit_disk() 
 {
-	std::random_device rd;  //Will be used to obtain a seed for the random number engine
-    std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-    std::uniform_real_distribution<> dis(-1.0, 1.0);
+    auto& sampler = Sampler::get();
     
     while (true) {
-        auto p = glm::vec3(dis(gen), dis(gen), 0);
+        auto u = sampler.get2D();
+        auto p = glm::vec3(2.f * u[0] - 1.f, 2.f * u[1] - 1.f, 0);
         if (p[0] * p[0] + p[1] * p[1] >= 1) continue;
         return p;
     }
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "rtPrimitives.h"
+
+// Primitive arrays
+// The objects of a scene copied into one contiguous array per type. A
+// reference tags the type next to the index, and visit() switches on it to
+// call the final class directly, so the hit tests of the scene hierarchy
+// leaves skip the virtual calls and the pointer chasing to objects scattered
+// over the heap. Types without an array of their own are kept by pointer and
+// dispatched as before.
+
+class PrimitiveArrays {
+  public:
+    enum Type { PLANE, SPHERE, CONE, CYLINDER, INSTANCE, OTHER };
+
+    struct Ref {
+        uint32_t type : 3;
+        uint32_t index : 29;
+    };
+
+    void clear();
+    // copies obj at the end of the array of its type
+    Ref add(const Primitive& obj);
+    // copies obj over its earlier copy, once it has moved
+    void update(Ref ref, const Primitive& obj);
+
+    // the copy standing for the object of ref
+    const Primitive& get(Ref ref) const { return visit(ref, [](const Primitive& obj) -> const Primitive& { return obj; }); }
+
+    // visitor(obj) with obj of the static type of the array ref points into
+    template<typename Visitor>
+    auto visit(Ref ref, Visitor&& visitor) const -> decltype(visitor(std::declval<const Sphere&>()));
+
+    // closest hit in [EPS, t_max) of the ray among the objects of refs[0, count),
+    // shrinking t_max to it, and whether any of them blocks the ray before t_max
+    bool intersect(const Ref* refs, unsigned count, const Ray& ray, float& t_max, Intersection& isect) const;
+    bool occluded(const Ref* refs, unsigned count, const Ray& ray, float t_max) const;
+
+  private:
+    std::vector<Plane> planes;
+    std::vector<Sphere> spheres;
+    std::vector<Cone> cones;
+    std::vector<Cylinder> cylinders;
+    std::vector<Instance> instances;
+    std::vector<const Primitive*> others;
+};
+
+template<typename Visitor>
+auto PrimitiveArrays::visit(Ref ref, Visitor&& visitor) const -> decltype(visitor(std::declval<const Sphere&>()))
+{
+    switch (ref.type){
+        case PLANE: return visitor(planes[ref.index]);
+        case SPHERE: return visitor(spheres[ref.index]);
+        case CONE: return visitor(cones[ref.index]);
+        case CYLINDER: return visitor(cylinders[ref.index]);
+        case INSTANCE: return visitor(instances[ref.index]);
+        default: return visitor(*others[ref.index]);
+    }
+}
+
+inline bool PrimitiveArrays::intersect(const Ref* refs, unsigned count, const Ray& ray, float& t_max, Intersection& isect) const
+{
+    bool hit = false;
+    for (unsigned i = 0; i < count; i++){
+        if (visit(refs[i], [&](const auto& obj){ return obj.intersect(ray, t_max, isect); })){
+            t_max = isect.t;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+inline bool PrimitiveArrays::occluded(const Ref* refs, unsigned count, const Ray& ray, float t_max) const
+{
+    for (unsigned i = 0; i < count; i++){
+        if (visit(refs[i], [&](const auto& obj){ return obj.occluded(ray, t_max); })) return true;
+    }
+    return false;
+}
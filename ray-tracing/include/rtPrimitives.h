@@ -1,21 +1,42 @@
 #pragma once
 
 #include "rtClasses.h"
+#include "rtBVH.h"
+#include "rtCompressedBVH.h"
+#include "rtTriangleBlock.h"
+#include "rtQuadrics.h"
 #include "ofMain.h"
 //#include <cmath>
 
 class Ray; 
 class HitRecord;
+struct Intersection;
 struct Triangle;
 
 // Abstract Class for any simple geometric objects
 
 class Primitive {
  public:
-    virtual HitRecord hit(const Ray& ray) const = 0;
+    // closest hit in [EPS, t_max), only fills in the compact intersection
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const = 0;
+    // hit point and normal, evaluated once for the final closest hit
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const = 0;
+    // true if the ray hits the object in [EPS, t_max), no hit record is built
+    virtual bool occluded(const Ray& ray, float t_max) const = 0;
+    // intersect and occluded for the rays of packet in active, each against
+    // its own entry of t_max. Return the rays hit, and fill in their entries of
+    // isects. Tested ray by ray unless a primitive has a packet version.
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const;
+    // intersect followed by getHitRecord, for one-off queries
+    HitRecord hit(const Ray& ray) const;
     virtual ofFloatColor getColor() const { return color; }
+    // colour at a hit on the object, the same everywhere unless it has a colour per part
+    virtual ofFloatColor getHitColor(const HitRecord& record) const { return color; }
     virtual float getSpecularCoeff() const { return specular_coeff;}
     virtual bool isReflectEnabled() const { return reflect; }
+    virtual AABB getBounds() const = 0;
+    virtual bool isBounded() const { return true; }
     virtual void rotate(const glm::mat4& m)=0;
     virtual void translate(const glm::mat4& m)=0;
     virtual void scale(const glm::mat4& m)=0;
@@ -29,10 +50,16 @@ class Primitive {
 
 // Plane Class
 
-class Plane: public Primitive {
+class Plane final: public Primitive {
  public:
     Plane(const glm::vec3& p, const glm::vec3& n, float spec_coef,const ofFloatColor& color);
-    virtual HitRecord hit(const Ray& ray) const override;
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override { return AABB(); };
+    virtual bool isBounded() const override { return false; };
     virtual void rotate(const glm::mat4& m) override {return;};
     virtual void translate(const glm::mat4& m) override {return;};
     virtual void scale(const glm::mat4& m) override {return;};
@@ -45,11 +72,16 @@ class Plane: public Primitive {
 
 // Sphere Class
 
-class Sphere: public Primitive {
+class Sphere final: public Primitive {
  public:
     Sphere() {};
     Sphere(float r, const glm::vec3& c,float spec_coef, const ofFloatColor& color);
-    virtual HitRecord hit(const Ray& ray) const override;
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override;
     virtual void rotate(const glm::mat4& m) override {return;};
     virtual void translate(const glm::mat4& m) override;
     virtual void scale(const glm::mat4& m) override;
@@ -62,10 +94,15 @@ class Sphere: public Primitive {
 
 // Cone class
 
-class Cone: public Primitive {
+class Cone final: public Primitive {
  public:
     Cone(const glm::vec3& c, const glm::vec3& o, float a,float spec_coef, const ofFloatColor& color);
-    virtual HitRecord hit(const Ray& ray) const override;
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override;
     virtual void rotate(const glm::mat4& m) override;
     virtual void translate(const glm::mat4& m) override;
     virtual void scale(const glm::mat4& m) override;
@@ -78,10 +115,15 @@ class Cone: public Primitive {
 
 // Cylinder class
 
-class Cylinder: public Primitive {
+class Cylinder final: public Primitive {
  public:
     Cylinder(const glm::vec3& c1, const glm::vec3& c2, float r,float spec_coef, const ofFloatColor& color);
-    virtual HitRecord hit(const Ray& ray) const override;
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override;
     
     virtual void rotate(const glm::mat4& m) override;
     virtual void translate(const glm::mat4& m) override;
@@ -101,7 +143,10 @@ class BBox: public Primitive {
     BBox() {};
     BBox(const glm::vec3& v1, const glm::vec3& v2);
 
-    virtual HitRecord hit(const Ray& ray) const override;
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual AABB getBounds() const override { return AABB(min, max); };
     
     virtual void rotate(const glm::mat4& m) override {return;};
     virtual void translate(const glm::mat4& m) override {return;};
@@ -113,25 +158,139 @@ class BBox: public Primitive {
 };
 
 // Mesh Model class
+// Triangles in object space, placed in the scene through Instances
 
 class Model: public Primitive {
  public:
     
-    Model(const glm::vec3& p, const ofFloatColor& col);
-    virtual HitRecord hit(const Ray& ray) const override;
+    Model(const ofFloatColor& col);
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override;
+
+    // builds the triangle hierarchy, call once the mesh is loaded. Without
+    // blocks the triangles are not laid out for tracing yet, for a mesh about
+    // to be compressed; buildBlocks does it later if it is not.
+    void build(BVHBuilder builder=BINNED_SAH, bool with_blocks=true);
+    void buildBlocks();
+    std::vector<AABB> getTriangleBounds() const;
+    // swaps the float hierarchy and vertices for the compressed layout, which
+    // moves the vertices by up to half a cell of a 16 bit grid over the mesh.
+    // Fails, keeping the float layout, on leaves too large for a compressed node.
+    bool compress();
+    bool isCompressed() const { return !compressed.empty(); }
+    // bytes taken by the hierarchy and the triangles, normals left out
+    size_t memoryUsage() const;
     
     virtual void rotate(const glm::mat4& m) override {return;};
     virtual void translate(const glm::mat4& m) override {return;};
     virtual void scale(const glm::mat4& m) override {return;};
     virtual void reset() override {return;};
 
+    // indexed triangles, for building and shading
     std::vector<Triangle> triangles;
     std::vector<glm::vec3> vertices, normals, pnormals;
+    // the same triangles in the order of bvh.indices, for tracing
+    std::vector<TriangleBlock> blocks;
 
     Sphere bounding_sphere;
     BBox bbox;
+    BVH bvh;
+    CompressedBVH compressed;
     bool use_precomputed;
-    
+};
+
+// SphereCloud class
+// Up to millions of spheres as a single object, for point clouds and
+// molecules. Centers and radii are packed in SphereLanes instead of a Sphere
+// object each, and every sphere has a colour of its own. The cloud keeps its
+// own hierarchy over groups of 8 spheres that follow each other along a
+// Morton curve, and the leaves are tested with the sphere kernel, one group
+// per iteration.
+
+class SphereCloud final: public Primitive {
+ public:
+    SphereCloud(float spec_coef, const ofFloatColor& color);
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override;
+    virtual ofFloatColor getHitColor(const HitRecord& record) const override { return colors[record.prim]; }
+
+    // a sphere of the colour of the cloud, or of its own, staged until build.
+    // Spheres added once the cloud is built are ignored.
+    void add(const glm::vec3& center, float radius);
+    void add(const glm::vec3& center, float radius, const ofFloatColor& color);
+    // groups the staged spheres and builds the hierarchy over the groups, call
+    // once every sphere is added. The last group is padded with copies of one
+    // of its spheres.
+    void build(BVHBuilder builder=BINNED_SAH);
+    bool isBuilt() const { return lanes.size() > 0; }
+    // spheres added, the padding left out
+    size_t size() const { return num_spheres; }
+    // bytes taken by the spheres, their colours and the hierarchy
+    size_t memoryUsage() const;
+
+    virtual void rotate(const glm::mat4& m) override {return;};
+    virtual void translate(const glm::mat4& m) override {return;};
+    virtual void scale(const glm::mat4& m) override {return;};
+    virtual void reset() override {return;};
+
+    // in the order of the groups of bvh.indices, empty until built
+    SphereLanes lanes;
+    std::vector<ofFloatColor> colors;
+    BVH bvh;
+
+ private:
+    size_t num_spheres;
+    // the spheres in the order they were added, until build consumes them
+    std::vector<glm::vec3> staged_centers;
+    std::vector<float> staged_radii;
+    std::vector<ofFloatColor> staged_colors;
+
+    // nearest hit among the spheres of the groups [first, first + count)
+    int intersectGroups(const Ray& ray, unsigned first, unsigned count, float t_max, float& t) const;
+};
+
+// Instance class
+// Places a shared primitive, typically a mesh with its own hierarchy, in the
+// scene through an affine transform. Rays are carried into object space for
+// the hit test, so any number of instances share a single copy of the geometry.
+
+class Instance final: public Primitive {
+ public:
+    Instance(std::shared_ptr<const Primitive> object, const Transform& to_world);
+    virtual bool intersect(const Ray& ray, float t_max, Intersection& isect) const override;
+    virtual HitRecord getHitRecord(const Ray& ray, const Intersection& isect) const override;
+    virtual bool occluded(const Ray& ray, float t_max) const override;
+    virtual RayMask intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const override;
+    virtual RayMask occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const override;
+    virtual AABB getBounds() const override { return to_world.apply(object_bounds); };
+
+    // rotations and scaling happen around the origin of the instance
+    virtual void rotate(const glm::mat4& m) override;
+    virtual void translate(const glm::mat4& m) override;
+    virtual void scale(const glm::mat4& m) override;
+    virtual void reset() override;
+
+    virtual ofFloatColor getHitColor(const HitRecord& record) const override { return object->getHitColor(record); }
+
+    std::shared_ptr<const Primitive> getObject() const { return object; }
+
  private:
-    glm::vec3 position;
-};
\ No newline at end of file
+    std::shared_ptr<const Primitive> object;
+    AABB object_bounds;
+    Transform to_world, to_object, to_world_default;
+
+    // the direction is not normalized, so distances along the ray stay the same
+    Ray toObject(const Ray& ray) const { return Ray(to_object.point(ray.o), to_object.vector(ray.d)); }
+    // every lane, inactive ones too, as the packet tests of some primitives
+    // run over all of them
+    RayPacket toObject(const RayPacket& packet) const;
+    void transformAroundOrigin(const glm::mat4& m);
+};
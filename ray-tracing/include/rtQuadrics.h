@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include "rtClasses.h"
+#include "rtRayPacket.h"
+
+// Quadric kernels
+// Sphere, cone and cylinder tests 8 at a time in the lanes of a register.
+// SphereLanes keeps spheres as a structure of arrays of floats, the way a
+// SphereCloud stores its spheres, so one ray is tested against 8 of them per
+// iteration. The arrays run width - 1 lanes past the last sphere, so a group
+// ending anywhere is read whole. Cones and cylinders are tested the other way
+// round, one of them against 8 rays of a packet per iteration.
+
+struct SphereLanes {
+    static const int width = 8;
+
+    std::vector<float> center[3], radius;
+
+    size_t size() const { return count; }
+    void clear();
+    // lane i, appended when i is size()
+    void set(size_t i, const glm::vec3& c, float r);
+    glm::vec3 getCenter(size_t i) const { return glm::vec3(center[0][i], center[1][i], center[2][i]); }
+
+  private:
+    size_t count = 0;
+};
+
+// Nearest hit in [EPS, t_max) of the ray among the count spheres of lanes
+// from first on. Returns its offset from first, and its distance in t, or -1.
+// The arithmetic is the one of Sphere::intersect, lane by lane, so both find
+// the same hits at the same distances.
+int intersectSpheres(const SphereLanes& lanes, unsigned first, unsigned count, const Ray& ray, float t_max, float& t);
+
+// Distances of the rays of a packet to one cone or cylinder, computed 8 rays
+// at a time with the arithmetic of their intersect, in t which holds
+// RayPacket::max_size floats. -INFINITY where a ray misses it or hits it
+// outside its height.
+void intersectConePacket(const RayPacket& packet, const glm::vec3& apex, const glm::vec3& axis, float cosa, float height, float* t);
+void intersectCylinderPacket(const RayPacket& packet, const glm::vec3& bottom, const glm::vec3& axis, float radius, float height, float* t);
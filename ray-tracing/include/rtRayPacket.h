@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include "rtClasses.h"
+
+// Ray packet
+// Rays traced together through the hierarchies, coherent ones such as the
+// primary rays of a block of pixels or the shadow rays of those pixels toward
+// one light. Stored as a structure of arrays, queries take the mask of the
+// rays of the packet still taking part.
+
+typedef uint64_t RayMask;
+
+struct RayPacket {
+    static const int max_size = 64;     // an 8 x 8 block of pixels
+
+    int size = 0;
+    float o[3][max_size], d[3][max_size];
+
+    void add(const Ray& ray) {
+        for (int axis = 0; axis < 3; axis++){
+            o[axis][size] = ray.o[axis];
+            d[axis][size] = ray.d[axis];
+        }
+        size++;
+    }
+
+    Ray ray(int k) const {
+        return Ray(glm::vec3(o[0][k], o[1][k], o[2][k]), glm::vec3(d[0][k], d[1][k], d[2][k]));
+    }
+
+    RayMask all() const { return size == max_size ? ~RayMask(0) : (RayMask(1) << size) - 1; }
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "rtClasses.h"
+#include "rtRayPacket.h"
+
+// Ray stream
+// Incoherent rays, such as the glossy reflections of every pixel of a tile,
+// gathered before any of them is traced. They are binned by a key made of the
+// octant and quantized direction within it, then the cell of their origin on
+// a grid over all the origins, so rays heading the same way from nearby
+// points are traced one after another and find the nodes and primitives they
+// need still in cache. Each bin goes through the hierarchy as ray packets.
+// ref: Pharr et al., "Rendering Complex Scenes with Memory-Coherent Ray Tracing", 1997
+
+class RayStream {
+  public:
+    static const int origin_bits = 3;       // per axis
+    static const int direction_bits = 2;    // per component within the octant
+
+    void clear();
+    // id identifies the ray to the caller once it is traced
+    void add(const Ray& ray, unsigned id);
+    size_t size() const { return rays.size(); }
+
+    // sorts the rays by bin, then calls trace(packet, ids) with up to a
+    // packet worth of rays of the same bin at a time. Every ray is passed on
+    // exactly once.
+    template<typename Tracer>
+    void trace(Tracer&& trace);
+
+  private:
+    std::vector<Ray> rays;
+    std::vector<unsigned> ids;
+    // bin key in the high half, ray in the low half
+    std::vector<uint64_t> order, scratch;
+
+    void sort();
+};
+
+template<typename Tracer>
+void RayStream::trace(Tracer&& trace)
+{
+    sort();
+
+    RayPacket packet;
+    unsigned packet_ids[RayPacket::max_size];
+    for (size_t i = 0; i < order.size(); i++){
+        unsigned idx = static_cast<unsigned>(order[i]);
+        packet_ids[packet.size] = ids[idx];
+        packet.add(rays[idx]);
+
+        bool bin_ends = i + 1 == order.size() || (order[i + 1] >> 32) != (order[i] >> 32);
+        if (bin_ends || packet.size == RayPacket::max_size){
+            trace(static_cast<const RayPacket&>(packet), static_cast<const unsigned*>(packet_ids));
+            packet.size = 0;
+        }
+    }
+}
@@ -1,42 +1,160 @@
 #pragma once
 
 #include <vector>
+#include <atomic>
 #include <chrono>
-#include <random>
+#include <functional>
 #include "rtClasses.h"
+#include "rtPrimitives.h"
+#include "rtPrimitiveArrays.h"
+#include "rtBVH.h"
 #include "rtCamera.h"
 #include "rtLight.h"
+#include "rtSampler.h"
+#include "rtRayStream.h"
+#include "rtWavefront.h"
 #include "ofMain.h"
 #include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
 
 
 typedef std::chrono::high_resolution_clock Clock;
 
+enum TileOrder { SCANLINE, MORTON, HILBERT };
+
+struct RenderSettings {
+    SamplerType sampler = UNIFORM;
+    int samples_per_pixel = 1;      // primary rays are jittered over the pixel past one sample
+    int tile_size = 16;
+    TileOrder tile_order = HILBERT; // used both across the tiles and within each tile
+    int progressive_samples = 1024; // progressive accumulation stops here
+    BVHBuilder bvh_builder = BINNED_SAH; // for the scene hierarchy and the meshes loaded afterwards
+    float rebuild_threshold = 0.25f;     // refitting gives way to a rebuild past this SAH cost growth
+    int packet_size = 0;            // primary and shadow rays of packet_size^2 pixels traced together, 0 for single rays
+    bool reflections = false;       // glossy reflections on the objects that enable them
+    bool ray_streams = false;       // reflection rays of a whole tile sorted into bins and traced together,
+                                    // the primary rays are then traced one by one
+    bool wavefront = false;         // whole frames rendered stage by stage from ray queues, see Wavefront
+};
+
 class RayTracer {
   public:
     RayTracer(int w, int h, Camera& c, const Viewport& v, 
       const AmbientLight& ambient);
 
-    float render(ofPixels& pixels, bool parallel=false);
+    // every render returns early, leaving the pixels partly written, once cancel is set
+    float render(ofPixels& pixels, bool parallel=false, const std::atomic<bool>* cancel=nullptr);
+    // same image with colors in [0, 1] and no 8 bit quantization
+    float render(ofFloatPixels& pixels, bool parallel=false, const std::atomic<bool>* cancel=nullptr);
+    // adds one sample per pixel to the accumulation buffer and writes the
+    // running average to pixels, until invalidate() starts over
+    float renderProgressive(ofPixels& pixels, bool parallel=false, const std::atomic<bool>* cancel=nullptr);
+    // to be called whenever the camera, the objects or the lights change
+    void invalidate();
+    int getAccumulatedSamples() const { return accumulated_samples; }
+    // milliseconds spent on the last update of the scene hierarchy
+    float getHierarchyBuildTime() const { return hierarchy_build_time; }
+    // rays and time of every stage of the last wavefront render
+    const StageStats* getStageStats() const { return wavefront_renderer.stats; }
     void addObject(std::shared_ptr<Primitive> obj);
+    // to be called after an object was transformed, its bounds are refitted into the hierarchy
+    void updateObject(const std::shared_ptr<Primitive>& obj);
     void addLight(std::shared_ptr<Light> light);
     std::shared_ptr<Primitive> selectObject(int i, int j) const;
 
     Viewport viewport;
     Camera& camera;
+    RenderSettings settings;
 
   private:
+    friend class Wavefront;
+
     int height, width;
+    int frame;
+    int accumulated_samples;
+    std::vector<glm::vec4> accumulation;
     AmbientLight ambient_light;
 
     std::vector<std::shared_ptr<Primitive>> objects;
     std::vector<std::shared_ptr<Light>> lights;
 
+    // top level hierarchy over the bounded objects, unbounded ones
+    // such as planes are tested separately on every ray
+    BVH scene_bvh;
+    std::vector<unsigned> bounded_objects, unbounded_objects;
+    std::vector<AABB> object_bounds;
+    // the objects as traced, copied by type in the order of the hierarchy
+    // leaves when it is built. object_refs maps every object to its copy.
+    PrimitiveArrays primitives;
+    std::vector<PrimitiveArrays::Ref> leaf_refs, unbounded_refs, object_refs;
+    // objects moved since the last update, refitted unless the set of objects changed
+    std::vector<unsigned> moved_objects;
+    bool rebuild_hierarchy;
+    BVHBuilder hierarchy_builder;
+    float hierarchy_cost, hierarchy_build_time;
+    Wavefront wavefront_renderer;
+
+    void updateSceneHierarchy();
+    void buildSceneHierarchy();
+    void compileObjects();
+
+    // image region [x0, x1) x [y0, y1) rendered as one task
+    struct Tile {
+        int x0, y0, x1, y1;
+    };
+
+    std::vector<Tile> getTiles() const;
+    std::vector<unsigned> getTilePixelOrder() const;
+    template<typename PixelType>
+    float renderFrame(ofPixels_<PixelType>& pixels, bool parallel, const std::atomic<bool>* cancel);
+    // shade(i, j) returns the color of a pixel in [0, 1], with packets on
+    // shade_block(block, colors) fills in the colors of a block of pixels
+    // row by row instead
+    typedef std::function<glm::vec4(int, int)> PixelShader;
+    typedef std::function<void(const Tile&, glm::vec4*)> BlockShader;
+    template<typename PixelType>
+    void renderTiles(ofPixels_<PixelType>& pixels, bool parallel, const PixelShader& shade,
+        const BlockShader& shade_block, const std::atomic<bool>* cancel) const;
+    // colors indexed j * width + i, as the wavefront renderer writes them
+    template<typename PixelType>
+    void storeImage(const std::vector<glm::vec4>& colors, ofPixels_<PixelType>& pixels) const;
+    template<typename PixelType>
+    void renderTile(const Tile& tile, const std::vector<unsigned>& pixel_order, ofPixels_<PixelType>& pixels,
+        const PixelShader& shade, const BlockShader& shade_block) const;
+
     HitRecord  traceRay(float x, float y) const;
     HitRecord testHit(const Ray& ray) const;
-    ofColor getPixelColor(int i, int j) const;
-    void performAntialiasing(float x, float y, std::vector<HitRecord>& arr) const;
+    bool occluded(const Ray& ray, float t_max) const;
+    // closest hits of the rays of packet in active, returns the rays that hit
+    RayMask testHit(const RayPacket& packet, RayMask active, Intersection* closest) const;
+    RayMask occluded(const RayPacket& packet, RayMask active, const float* t_max) const;
+    glm::vec4 getPixelColor(int i, int j) const;
+    // starts the sampler of a sample of pixel (i, j) and returns the position
+    // of its primary ray, jittered over the pixel by the first two dimensions
+    glm::vec2 startSample(int i, int j, int sample, bool jitter) const;
+    glm::vec4 getSampleColor(int i, int j, int sample, bool jitter, std::vector<Ray>* deferred_rays=nullptr) const;
+    // one sample of every pixel of block, traced as packets
+    void getBlockColors(const Tile& block, int sample, bool jitter, glm::vec4* colors) const;
+    // one sample of every pixel of tile, with the reflection rays of the
+    // whole tile traced as a sorted stream
+    void getStreamColors(const Tile& tile, int sample, bool jitter, glm::vec4* colors) const;
+
+    static const int reflection_rays = 64;     // per light
+    void getReflectionRays(const HitRecord& record, Ray* rays) const;
     glm::vec4 getReflectionColor(const HitRecord& record,  const std::shared_ptr<Light>&) const;
-    void performShading(const HitRecord& record, glm::vec4& color) const;
-    glm::vec4 getIntensity(const HitRecord& record, const std::shared_ptr<Light>& light) const;
+    // light brought by one reflection ray, shaded at the hit it found with
+    // the point and outward normal of its hit record, as a primary hit is
+    glm::vec4 getReflectedColor(const HitRecord& reflect_record, const std::shared_ptr<Light>& light, const bool* visible=nullptr) const;
+    // average of the reflected colors of the rays toward one light
+    glm::vec4 averageReflections(const glm::vec4* reflected) const;
+    // visible holds the result of the shadow ray toward every light when
+    // they were traced beforehand. With deferred_rays, the reflection rays
+    // are appended there for the caller to trace, reflection_rays of them per
+    // light, and left out of color.
+    void performShading(const HitRecord& record, glm::vec4& color, const bool* visible=nullptr,
+        std::vector<Ray>* deferred_rays=nullptr) const;
+    // color of the object under the lights, reflections aside
+    glm::vec4 getObjectColor(const HitRecord& record, const bool* visible=nullptr) const;
+    glm::vec4 getIntensity(const HitRecord& record, const std::shared_ptr<Light>& light, const bool* visible=nullptr) const;
+    Ray getShadowRay(const HitRecord& record, const Light& light, float& t_max) const;
 };
\ No newline at end of file
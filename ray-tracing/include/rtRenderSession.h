@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "rtRayTracer.h"
+#include "ofMain.h"
+
+// Render Session class
+// Renders on a background thread so the UI thread never waits on the
+// raytracer. The scene is only touched from that thread: changes are
+// queued with edit() and applied between two passes, which cancels the
+// pass in flight and folds a burst of edits into a single re-render.
+// Finished frames are swapped into a front buffer that fetchFrame() hands
+// over to the UI thread.
+
+class RenderSession {
+  public:
+    RenderSession(RayTracer& raytracer, int width, int height, bool progressive=true);
+    ~RenderSession();
+
+    void start();
+    void stop();
+
+    // queues a change to the scene or the render settings, which returns whether
+    // it changed anything. The pass in flight is cancelled, and the image restarts
+    // after a change or a cancelled pass.
+    void edit(std::function<bool()> change);
+    // queues a task that only reads the scene, the image keeps accumulating
+    void query(std::function<void()> task);
+
+    // swaps the last finished frame into pixels, false if there was none since the last call
+    bool fetchFrame(ofPixels& pixels);
+
+    void setProgressive(bool enable);
+    bool isProgressive() const { return progressive; }
+    float getRenderTime() const { return render_time; }
+    // last build or refit of the scene hierarchy as of the last finished frame, in ms
+    float getHierarchyBuildTime() const { return hierarchy_build_time; }
+    int getAccumulatedSamples() const { return accumulated_samples; }
+
+  private:
+    // returns whether the image has to restart
+    typedef std::function<bool()> Task;
+
+    void run();
+    bool hasWork() const;
+
+    RayTracer& raytracer;
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+
+    std::vector<Task> pending;
+    bool stopping, needs_frame, frame_ready;
+    std::atomic<bool> progressive, cancel;
+    std::atomic<float> render_time, hierarchy_build_time;
+    std::atomic<int> accumulated_samples;
+
+    ofPixels back_buffer, front_buffer;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "ofMain.h"
+
+// PCG32 random number generator, 16 bytes of state
+// ref: https://www.pcg-random.org/download.html
+
+class PCG32 {
+  public:
+    PCG32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    PCG32(uint64_t init_state, uint64_t init_seq) { seed(init_state, init_seq); }
+
+    void seed(uint64_t init_state, uint64_t init_seq) {
+        state = 0u;
+        inc = (init_seq << 1u) | 1u;
+        next();
+        state += init_state;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        uint32_t xor_shifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = static_cast<uint32_t>(old_state >> 59u);
+        return (xor_shifted >> rot) | (xor_shifted << ((-rot) & 31));
+    }
+
+    // uniform float in [0, 1)
+    float uniform() { return (next() >> 8) * 0x1p-24f; }
+
+  private:
+    uint64_t state, inc;
+};
+
+// 64 bit finalizer of MurmurHash3, used to turn sample coordinates into seeds
+static inline uint64_t mix_bits(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    v *= 0xc4ceb9fe1a85ec53ULL;
+    v ^= v >> 33;
+    return v;
+}
+
+enum SamplerType { UNIFORM, HALTON, SOBOL, BLUE_NOISE };
+
+// Abstract Sampler class
+// Source of every random number used while shading a pixel sample. Each
+// thread owns one sampler of every type; start() reseeds the requested one
+// from (pixel, sample, frame) and makes it current, so an image only depends
+// on those coordinates and not on how the pixels were spread over threads.
+// Successive get1D/get2D calls walk through the dimensions of the sample.
+
+class Sampler {
+  public:
+    virtual ~Sampler() {}
+
+    virtual void startPixelSample(int x, int y, int sample, int frame);
+    virtual float get1D() = 0;
+    virtual glm::vec2 get2D() = 0;
+
+    // the calling thread's sampler of the given type, started on a pixel sample
+    static Sampler& start(SamplerType type, int x, int y, int sample, int frame);
+    // the sampler last started on the calling thread
+    static Sampler& get();
+    static const char* getName(SamplerType type);
+
+  protected:
+    int px, py, sample_index, dimension;
+    uint64_t pixel_seed, frame_seed;
+    PCG32 rng;
+};
+
+// independent uniform random numbers
+class UniformSampler: public Sampler {
+  public:
+    virtual float get1D() override { return rng.uniform(); }
+    virtual glm::vec2 get2D() override;
+};
+
+// Owen scrambled Sobol points, padded to any number of dimensions by
+// shuffling the sample index independently per dimension
+// ref: Burley, "Practical Hash-based Owen Scrambling", JCGT 2020
+class SobolSampler: public Sampler {
+  public:
+    virtual float get1D() override;
+    virtual glm::vec2 get2D() override;
+};
+
+// Halton points with every digit scrambled by a hash of the digits above it,
+// falls back to uniform numbers past the last tabulated prime
+class HaltonSampler: public Sampler {
+  public:
+    static const int max_dimension = 32;
+
+    virtual float get1D() override;
+    virtual glm::vec2 get2D() override;
+
+  private:
+    float scrambledRadicalInverse(int dim, uint32_t index) const;
+};
+
+// golden ratio (R1/R2) sequences over the samples of a pixel, rotated per
+// pixel by a tiled void-and-cluster blue noise mask so that the error left
+// at low sample counts is spread as high frequency noise
+class BlueNoiseSampler: public Sampler {
+  public:
+    static const int mask_size = 64;
+
+    virtual float get1D() override;
+    virtual glm::vec2 get2D() override;
+
+  private:
+    float maskValue(int offset_x, int offset_y) const;
+    static const std::vector<float>& getMask();
+    static std::vector<float> generateMask();
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include "rtRayTracer.h"
+#include "rtCamera.h"
+#include "rtLight.h"
+#include "ofMain.h"
+
+// Scene class
+// Camera, lights and primitives of the demo scene, shared by the app and
+// the command line renderer.
+
+class Scene {
+  public:
+    Scene(int width, int height);
+
+    // adds an instance of every shape of an OBJ file to the raytracer, placed at position
+    bool loadObjModels(const std::string& filename, const glm::vec3& position);
+    // adds a point cloud as one SphereCloud placed at position, read from a text
+    // file of "x y z [radius] [r g b]" lines with colours from 0 to 255. Points
+    // without a radius of their own get radius, lines starting with # are skipped.
+    bool loadSphereCloud(const std::string& filename, const glm::vec3& position, float radius);
+
+    std::unique_ptr<Camera> camera;
+    std::unique_ptr<RayTracer> raytracer;
+    std::shared_ptr<Primitive> sphere, plane, cone, cylinder;
+    // every mesh loaded from now on is compressed, see Model::compress
+    bool compress_meshes;
+    float build_time;   // seconds spent building the hierarchies of the loaded models and clouds
+
+    // the meshes loaded so far, in object space
+    std::vector<std::shared_ptr<Model>> getMeshes() const;
+
+  private:
+    // object space meshes of every OBJ file loaded so far, shared by their instances
+    std::map<std::string, std::vector<std::shared_ptr<Model>>> meshes;
+    float min_x, max_x, min_y, max_y, min_z, max_z;
+    bool loadMeshes(const std::string& filename, std::vector<std::shared_ptr<Model>>& models);
+    void updateMinMax(float x, float y, float z);
+};
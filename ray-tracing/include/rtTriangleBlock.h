@@ -0,0 +1,216 @@
+#pragma once
+
+#include "rtClasses.h"
+#include "rtBVH.h"
+
+// Trace time triangles
+// The vertices of width consecutive slots of the hierarchy indices as a
+// structure of arrays, so the triangles of a leaf are one contiguous read
+// and one ray is tested against a whole block in the lanes of a register.
+// Vertices are stored as they are rather than as edges: a shared edge has
+// to be computed from the same values in both of its triangles for the
+// test to be watertight.
+
+struct alignas(64) TriangleBlock {
+#if defined(__AVX512F__)
+    static const int width = 16;
+#elif defined(__AVX__)
+    static const int width = 8;
+#else
+    static const int width = 4;
+#endif
+    float v[3][3][width];       // vertex, axis, lane
+};
+
+// Ray set up for the watertight test. The axes are permuted so the ray runs
+// along the largest component of its direction, then sheared so it runs
+// along +z from the origin. The hit test is left with the signs of three 2D
+// edge functions, which agree on the edge two triangles share, so a ray
+// never slips between them.
+// ref: Woop et al., "Watertight Ray/Triangle Intersection", 2013
+struct ShearedRay {
+    glm::vec3 o;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    ShearedRay() {}
+    explicit ShearedRay(const Ray& ray): o(ray.o) {
+        kz = 0;
+        for (int axis = 1; axis < 3; axis++){
+            if (std::abs(ray.d[axis]) > std::abs(ray.d[kz])) kz = axis;
+        }
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keeps the winding of the triangles as seen along the ray
+        if (ray.d[kz] < 0.f) std::swap(kx, ky);
+
+        sx = ray.d[kx] / ray.d[kz];
+        sy = ray.d[ky] / ray.d[kz];
+        sz = 1.f / ray.d[kz];
+    }
+};
+
+// Hits in (EPS, t_max) on the front face of one triangle, with the
+// barycentric coordinates of B and C
+inline bool intersectTriangle(const ShearedRay& ray, const glm::vec3& A, const glm::vec3& B, const glm::vec3& C,
+    float t_max, float& t, float& alpha, float& beta)
+{
+    auto a = subtract_vecs(A, ray.o), b = subtract_vecs(B, ray.o), c = subtract_vecs(C, ray.o);
+    float ax = a[ray.kx] - ray.sx * a[ray.kz], ay = a[ray.ky] - ray.sy * a[ray.kz];
+    float bx = b[ray.kx] - ray.sx * b[ray.kz], by = b[ray.ky] - ray.sy * b[ray.kz];
+    float cx = c[ray.kx] - ray.sx * c[ray.kz], cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+    // scaled barycentric coordinates, all positive inside a front face
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if (u < 0.f || v < 0.f || w < 0.f) return false;
+
+    float det = u + v + w;
+    if (det <= 0.f) return false;
+
+    float T = ray.sz * (u * a[ray.kz] + v * b[ray.kz] + w * c[ray.kz]);
+    if (T <= EPS * det || T >= t_max * det) return false;
+
+    t = T / det;
+    alpha = v / det;
+    beta = w / det;
+    return true;
+}
+
+// Tests the ray against the lanes of block set in mask, all at once. Returns
+// the lane of the nearest hit in (EPS, t_max) or -1, along with its distance
+// and the barycentric coordinates of its second and third vertex.
+inline int intersectBlock(const TriangleBlock& block, unsigned mask, const ShearedRay& ray,
+    float t_max, float& t, float& alpha, float& beta)
+{
+    const int width = TriangleBlock::width;
+    const float (*A)[width] = block.v[0], (*B)[width] = block.v[1], (*C)[width] = block.v[2];
+    const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+    alignas(64) float t_lane[width], det_lane[width], v_lane[width], w_lane[width];
+
+    // the products of the edge functions are rounded before they are
+    // subtracted, a fused multiply-add would break their symmetry
+#if defined(__AVX512F__)
+    __m512 ox = _mm512_set1_ps(ray.o[kx]), oy = _mm512_set1_ps(ray.o[ky]), oz = _mm512_set1_ps(ray.o[kz]);
+    __m512 sx = _mm512_set1_ps(ray.sx), sy = _mm512_set1_ps(ray.sy);
+    __m512 az = _mm512_sub_ps(_mm512_load_ps(A[kz]), oz);
+    __m512 bz = _mm512_sub_ps(_mm512_load_ps(B[kz]), oz);
+    __m512 cz = _mm512_sub_ps(_mm512_load_ps(C[kz]), oz);
+    __m512 ax = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(A[kx]), ox), _mm512_mul_ps(sx, az));
+    __m512 ay = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(A[ky]), oy), _mm512_mul_ps(sy, az));
+    __m512 bx = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(B[kx]), ox), _mm512_mul_ps(sx, bz));
+    __m512 by = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(B[ky]), oy), _mm512_mul_ps(sy, bz));
+    __m512 cx = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(C[kx]), ox), _mm512_mul_ps(sx, cz));
+    __m512 cy = _mm512_sub_ps(_mm512_sub_ps(_mm512_load_ps(C[ky]), oy), _mm512_mul_ps(sy, cz));
+
+    __m512 u = _mm512_sub_ps(_mm512_mul_ps(cx, by), _mm512_mul_ps(cy, bx));
+    __m512 v = _mm512_sub_ps(_mm512_mul_ps(ax, cy), _mm512_mul_ps(ay, cx));
+    __m512 w = _mm512_sub_ps(_mm512_mul_ps(bx, ay), _mm512_mul_ps(by, ax));
+    __m512 zero = _mm512_setzero_ps();
+    __m512 det = _mm512_add_ps(_mm512_add_ps(u, v), w);
+    __m512 T = _mm512_mul_ps(_mm512_set1_ps(ray.sz),
+        _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(u, az), _mm512_mul_ps(v, bz)), _mm512_mul_ps(w, cz)));
+
+    __mmask16 hits = _mm512_cmp_ps_mask(u, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ)
+        & _mm512_cmp_ps_mask(w, zero, _CMP_GE_OQ) & _mm512_cmp_ps_mask(det, zero, _CMP_GT_OQ)
+        & _mm512_cmp_ps_mask(T, _mm512_mul_ps(_mm512_set1_ps(EPS), det), _CMP_GT_OQ)
+        & _mm512_cmp_ps_mask(T, _mm512_mul_ps(_mm512_set1_ps(t_max), det), _CMP_LT_OQ);
+    mask &= hits;
+    if (!mask) return -1;
+    _mm512_store_ps(t_lane, _mm512_div_ps(T, det));
+    _mm512_store_ps(det_lane, det);
+    _mm512_store_ps(v_lane, v);
+    _mm512_store_ps(w_lane, w);
+#elif defined(__AVX__)
+    __m256 ox = _mm256_set1_ps(ray.o[kx]), oy = _mm256_set1_ps(ray.o[ky]), oz = _mm256_set1_ps(ray.o[kz]);
+    __m256 sx = _mm256_set1_ps(ray.sx), sy = _mm256_set1_ps(ray.sy);
+    __m256 az = _mm256_sub_ps(_mm256_load_ps(A[kz]), oz);
+    __m256 bz = _mm256_sub_ps(_mm256_load_ps(B[kz]), oz);
+    __m256 cz = _mm256_sub_ps(_mm256_load_ps(C[kz]), oz);
+    __m256 ax = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(A[kx]), ox), _mm256_mul_ps(sx, az));
+    __m256 ay = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(A[ky]), oy), _mm256_mul_ps(sy, az));
+    __m256 bx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(B[kx]), ox), _mm256_mul_ps(sx, bz));
+    __m256 by = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(B[ky]), oy), _mm256_mul_ps(sy, bz));
+    __m256 cx = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(C[kx]), ox), _mm256_mul_ps(sx, cz));
+    __m256 cy = _mm256_sub_ps(_mm256_sub_ps(_mm256_load_ps(C[ky]), oy), _mm256_mul_ps(sy, cz));
+
+    __m256 u = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+    __m256 v = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+    __m256 w = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+    __m256 zero = _mm256_setzero_ps();
+    __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+    __m256 T = _mm256_mul_ps(_mm256_set1_ps(ray.sz),
+        _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, az), _mm256_mul_ps(v, bz)), _mm256_mul_ps(w, cz)));
+
+    __m256 hits = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(v, zero, _CMP_GE_OQ)),
+        _mm256_and_ps(_mm256_cmp_ps(w, zero, _CMP_GE_OQ), _mm256_cmp_ps(det, zero, _CMP_GT_OQ)));
+    hits = _mm256_and_ps(hits, _mm256_and_ps(
+        _mm256_cmp_ps(T, _mm256_mul_ps(_mm256_set1_ps(EPS), det), _CMP_GT_OQ),
+        _mm256_cmp_ps(T, _mm256_mul_ps(_mm256_set1_ps(t_max), det), _CMP_LT_OQ)));
+    mask &= _mm256_movemask_ps(hits);
+    if (!mask) return -1;
+    _mm256_store_ps(t_lane, _mm256_div_ps(T, det));
+    _mm256_store_ps(det_lane, det);
+    _mm256_store_ps(v_lane, v);
+    _mm256_store_ps(w_lane, w);
+#elif defined(__SSE__) || defined(_M_X64)
+    __m128 ox = _mm_set1_ps(ray.o[kx]), oy = _mm_set1_ps(ray.o[ky]), oz = _mm_set1_ps(ray.o[kz]);
+    __m128 sx = _mm_set1_ps(ray.sx), sy = _mm_set1_ps(ray.sy);
+    __m128 az = _mm_sub_ps(_mm_load_ps(A[kz]), oz);
+    __m128 bz = _mm_sub_ps(_mm_load_ps(B[kz]), oz);
+    __m128 cz = _mm_sub_ps(_mm_load_ps(C[kz]), oz);
+    __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(A[kx]), ox), _mm_mul_ps(sx, az));
+    __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(A[ky]), oy), _mm_mul_ps(sy, az));
+    __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(B[kx]), ox), _mm_mul_ps(sx, bz));
+    __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(B[ky]), oy), _mm_mul_ps(sy, bz));
+    __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(C[kx]), ox), _mm_mul_ps(sx, cz));
+    __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(C[ky]), oy), _mm_mul_ps(sy, cz));
+
+    __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+    __m128 zero = _mm_setzero_ps();
+    __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+    __m128 T = _mm_mul_ps(_mm_set1_ps(ray.sz),
+        _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz)));
+
+    __m128 hits = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)),
+        _mm_and_ps(_mm_cmpge_ps(w, zero), _mm_cmpgt_ps(det, zero)));
+    hits = _mm_and_ps(hits, _mm_and_ps(_mm_cmpgt_ps(T, _mm_mul_ps(_mm_set1_ps(EPS), det)),
+        _mm_cmplt_ps(T, _mm_mul_ps(_mm_set1_ps(t_max), det))));
+    mask &= _mm_movemask_ps(hits);
+    if (!mask) return -1;
+    _mm_store_ps(t_lane, _mm_div_ps(T, det));
+    _mm_store_ps(det_lane, det);
+    _mm_store_ps(v_lane, v);
+    _mm_store_ps(w_lane, w);
+#else
+    unsigned hits = 0;
+    for (int lane = 0; lane < width; lane++){
+        if (!(mask & (1u << lane))) continue;
+        float a, b;
+        glm::vec3 p0(A[0][lane], A[1][lane], A[2][lane]);
+        glm::vec3 p1(B[0][lane], B[1][lane], B[2][lane]);
+        glm::vec3 p2(C[0][lane], C[1][lane], C[2][lane]);
+        if (!intersectTriangle(ray, p0, p1, p2, t_max, t_lane[lane], a, b)) continue;
+        hits |= 1u << lane;
+        det_lane[lane] = 1.f;
+        v_lane[lane] = a;
+        w_lane[lane] = b;
+    }
+    mask &= hits;
+    if (!mask) return -1;
+#endif
+
+    // nearest of the lanes hit
+    int nearest = __builtin_ctz(mask);
+    for (mask &= mask - 1; mask; mask &= mask - 1){
+        int lane = __builtin_ctz(mask);
+        if (t_lane[lane] < t_lane[nearest]) nearest = lane;
+    }
+    t = t_lane[nearest];
+    alpha = v_lane[nearest] / det_lane[nearest];
+    beta = w_lane[nearest] / det_lane[nearest];
+    return nearest;
+}
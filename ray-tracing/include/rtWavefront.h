@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include "rtClasses.h"
+#include "rtRayPacket.h"
+
+class RayTracer;
+
+// Ray queue
+// Rays handed from one wavefront stage to the next, stored as a structure of
+// arrays. Producers on any thread reserve a range of slots with one atomic
+// add and fill it in, no lock is ever taken. item tells the consumer which
+// pixel or reflection ray the ray belongs to.
+
+struct RayQueue {
+    std::vector<float> o[3], d[3], t_max;
+    std::vector<unsigned> item;
+    std::atomic<size_t> count{0};
+
+    // empties the queue, making room for capacity rays
+    void reset(size_t capacity);
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+    // first of n consecutive slots for the caller to fill in
+    size_t reserve(size_t n) { return count.fetch_add(n, std::memory_order_relaxed); }
+
+    void set(size_t slot, const Ray& ray, float t, unsigned id) {
+        for (int axis = 0; axis < 3; axis++){
+            o[axis][slot] = ray.o[axis];
+            d[axis][slot] = ray.d[axis];
+        }
+        t_max[slot] = t;
+        item[slot] = id;
+    }
+
+    // the n rays from first on, n at most RayPacket::max_size
+    void getPacket(size_t first, int n, RayPacket& packet) const;
+};
+
+// Wavefront integrator
+// Renders one sample of every pixel as a sequence of stages instead of
+// following each pixel from camera to light. The pixels go through in waves
+// of wave_pixels, tile by tile. Each stage runs one tight kernel over a whole
+// queue, spread across the cores, and fills the queues of the next ones:
+//   generate  camera rays into the primary queue
+//   extend    closest hits of the primary or reflection queue, as packets
+//   shade     shadow rays of the hits, and their reflection rays into the
+//             reflection queue, then the final colors
+//   shadow    visibility of the shadow rays, as packets
+// Reflection hits go through shade and shadow again on their own queues.
+// The colors come out the same as with the tiled renderer.
+
+struct StageStats {
+    const char* name;
+    size_t rays = 0;
+    double seconds = 0.0;
+};
+
+class Wavefront {
+  public:
+    static const int wave_pixels = 2048;
+    enum Stage { GENERATE, EXTEND, SHADE, SHADOW, STAGES };
+
+    explicit Wavefront(const RayTracer& tracer);
+
+    // one sample of every pixel into colors, indexed j * width + i. Returns
+    // early, leaving colors partly written, once cancel is set.
+    void renderSample(int sample, bool jitter, glm::vec4* colors, bool parallel, const std::atomic<bool>* cancel);
+    void resetStats();
+
+    // rays through every stage and time spent there since resetStats()
+    StageStats stats[STAGES];
+
+  private:
+    const RayTracer& tracer;
+    RayQueue primary, reflection, shadow, reflection_shadow;
+
+    // per pixel of the wave
+    std::vector<HitRecord> records;
+    std::vector<char> visible, reflective;
+    // per reflection ray of the wave, reflection_rays per light of each pixel
+    std::vector<HitRecord> reflect_records;
+    std::vector<glm::vec4> reflected;
+
+    // pixels of the image, j * width + i, tile after tile
+    std::vector<unsigned> pixel_order;
+
+    void renderWave(const unsigned* pixels, size_t count, int sample, bool jitter, glm::vec4* colors, bool parallel);
+    // closest hits of the rays of queue, hit(item, ray, closest) for each,
+    // closest is null for the rays that hit nothing
+    template<typename Handler>
+    void extend(const RayQueue& queue, bool parallel, Handler&& hit);
+    // shadow rays of queue, lit(item, visible) for each
+    template<typename Handler>
+    void traceShadows(const RayQueue& queue, bool parallel, Handler&& lit);
+    template<typename Kernel>
+    void runStage(Stage stage, size_t rays, Kernel&& kernel);
+};
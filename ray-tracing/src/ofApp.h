@@ -3,6 +3,9 @@
 #include "ofxGui.h"
 #include "ofMain.h"
 #include "rtRayTracer.h"
+#include "rtScene.h"
+#include "rtBenchmark.h"
+#include "rtRenderSession.h"
 #include "rtTransformation.h"
 #include "rtCamera.h"
 #include "rtLight.h"
@@ -27,22 +30,25 @@ class ofApp : public ofBaseApp{
 		void dragEvent(ofDragInfo dragInfo);
 		void gotMessage(ofMessage msg);
 
-		bool loadObjModels(const std::string& filename, const glm::vec3& position);
-		void updateMinMax(float x, float y, float z);
+		// runs on the render thread, see RenderSession::edit. Returns whether the
+		// key changed the camera, the selected object or the render settings.
+		bool applyKey(int key);
 
 		int width, height;
-		float min_x, max_x, min_y, max_y, min_z, max_z;
 		
 		ofTexture texColor;
 		ofPixels colorPixels;
 
 		ofParameter<float> render_time;
+		ofParameter<float> build_time;
+		ofParameter<float> hierarchy_time;
+		ofParameter<int> accumulated_samples;
   		ofxPanel gui;
 
-		std::unique_ptr<RayTracer> raytracer;
-		std::unique_ptr<Camera> camera;
-
-		std::shared_ptr<Primitive> sphere, plane, cone, cylinder, s1;
+		std::unique_ptr<Scene> scene;
 		std::shared_ptr<Primitive> object;
+
+		// declared last so the render thread stops before the scene goes away
+		std::unique_ptr<RenderSession> session;
 		
 };
@@ -0,0 +1,798 @@
+#include "rtBVH.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/parallel_invoke.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_sort.h"
+
+// ref: https://jacco.ompf2.com/2022/04/21/how-to-build-a-bvh-part-3-quick-builds/
+// ref: Wald, "On fast Construction of SAH-based Bounding Volume Hierarchies", 2007
+
+// func(begin, end, value) folds a range of primitives into value, which starts
+// out as the identity. The partial values of a large range are computed in
+// parallel and merged with join.
+template<typename T, typename Func, typename Join>
+static void reduce_range(unsigned first, unsigned count, T& value, const Func& func, const Join& join)
+{
+    if (count < BVH::parallel_min_size){
+        func(first, first + count, value);
+        return;
+    }
+
+    value = tbb::parallel_reduce(tbb::blocked_range<unsigned>(first, first + count, 1024), value,
+        [&](const tbb::blocked_range<unsigned>& range, T partial){
+            func(range.begin(), range.end(), partial);
+            return partial;
+        }, join);
+}
+
+static int bin_index(const glm::vec3& centroid, int axis, float c_min, float scale)
+{
+    return std::min(BVH::num_bins - 1, static_cast<int>((centroid[axis] - c_min) * scale));
+}
+
+void BVH::build(const std::vector<AABB>& prim_bounds, BVHBuilder builder, const SplitFunction& split_prim)
+{
+    parents.clear();
+    prim_leaves.clear();
+    wide_slots.clear();
+    nodes.clear();
+    wide_nodes.clear();
+    indices.resize(prim_bounds.size());
+    if (prim_bounds.empty()) return;
+
+    unsigned n = prim_bounds.size();
+    std::vector<glm::vec3> centroids(n);
+    tbb::parallel_for(tbb::blocked_range<unsigned>(0, n, 4096), [&](const tbb::blocked_range<unsigned>& range){
+        for (unsigned i = range.begin(); i != range.end(); i++){
+            indices[i] = i;
+            centroids[i] = prim_bounds[i].centroid();
+        }
+    });
+
+    if (builder == LINEAR){
+        buildLinear(prim_bounds, centroids);
+        collapse();
+        return;
+    }
+    if (builder == SPATIAL){
+        buildSpatial(prim_bounds, split_prim);
+        collapse();
+        return;
+    }
+
+    // a binary tree over n primitives never has more than 2n - 1 nodes, slots
+    // are handed out in pairs from a shared counter as subtrees get split
+    nodes.resize(2 * n - 1);
+    std::atomic<unsigned> node_count(1);
+    nodes[0].left_first = 0;
+    nodes[0].count = n;
+    nodes[0].box = computeBounds(0, n, prim_bounds);
+
+    subdivide(0, 0, prim_bounds, centroids, node_count);
+    nodes.resize(node_count);
+    nodes.shrink_to_fit();
+    collapse();
+}
+
+AABB BVH::computeBounds(unsigned first, unsigned count, const std::vector<AABB>& prim_bounds) const
+{
+    AABB bounds;
+    reduce_range(first, count, bounds,
+        [&](unsigned begin, unsigned end, AABB& box){
+            for (unsigned i = begin; i < end; i++) box.grow(prim_bounds[indices[i]]);
+        },
+        [](AABB a, const AABB& b){ a.grow(b); return a; });
+    return bounds;
+}
+
+BVH::Split BVH::findBestSplit(const Node& node, const std::vector<AABB>& prim_bounds,
+    const std::vector<glm::vec3>& centroids) const
+{
+    Split best;
+
+    AABB centroid_bounds;
+    reduce_range(node.left_first, node.count, centroid_bounds,
+        [&](unsigned begin, unsigned end, AABB& box){
+            for (unsigned i = begin; i < end; i++) box.grow(centroids[indices[i]]);
+        },
+        [](AABB a, const AABB& b){ a.grow(b); return a; });
+
+    float c_min[3], scale[3];
+    for (int axis = 0; axis < 3; axis++){
+        c_min[axis] = centroid_bounds.min[axis];
+        float extent = centroid_bounds.max[axis] - c_min[axis];
+        scale[axis] = extent > 0.f ? num_bins / extent : 0.f;
+    }
+
+    // bin the primitives by their centroid, on all three axes in one pass
+    struct Bins {
+        AABB box[3][num_bins];
+        unsigned count[3][num_bins] = {};
+    };
+    Bins bins;
+    reduce_range(node.left_first, node.count, bins,
+        [&](unsigned begin, unsigned end, Bins& bins){
+            for (unsigned i = begin; i < end; i++){
+                auto idx = indices[i];
+                const auto& centroid = centroids[idx];
+                const auto& box = prim_bounds[idx];
+                int bin_x = bin_index(centroid, 0, c_min[0], scale[0]);
+                int bin_y = bin_index(centroid, 1, c_min[1], scale[1]);
+                int bin_z = bin_index(centroid, 2, c_min[2], scale[2]);
+                bins.count[0][bin_x]++;
+                bins.count[1][bin_y]++;
+                bins.count[2][bin_z]++;
+                bins.box[0][bin_x].grow(box);
+                bins.box[1][bin_y].grow(box);
+                bins.box[2][bin_z].grow(box);
+            }
+        },
+        [](Bins a, const Bins& b){
+            for (int axis = 0; axis < 3; axis++){
+                for (int i = 0; i < num_bins; i++){
+                    a.count[axis][i] += b.count[axis][i];
+                    a.box[axis][i].grow(b.box[axis][i]);
+                }
+            }
+            return a;
+        });
+
+    for (int axis = 0; axis < 3; axis++){
+        if (scale[axis] == 0.f) continue;
+        const AABB* bin_box = bins.box[axis];
+        const unsigned* bin_count = bins.count[axis];
+
+        // sweep from both sides to gather the areas of every split plane
+        float left_area[num_bins - 1], right_area[num_bins - 1];
+        unsigned left_count[num_bins - 1], right_count[num_bins - 1];
+        AABB left_boxes[num_bins - 1], right_boxes[num_bins - 1];
+        AABB left_box, right_box;
+        unsigned left_sum = 0, right_sum = 0;
+        for (int i = 0; i < num_bins - 1; i++){
+            left_sum += bin_count[i];
+            left_count[i] = left_sum;
+            left_box.grow(bin_box[i]);
+            left_boxes[i] = left_box;
+            left_area[i] = left_box.area();
+
+            right_sum += bin_count[num_bins - 1 - i];
+            right_count[num_bins - 2 - i] = right_sum;
+            right_box.grow(bin_box[num_bins - 1 - i]);
+            right_boxes[num_bins - 2 - i] = right_box;
+            right_area[num_bins - 2 - i] = right_box.area();
+        }
+
+        for (int i = 0; i < num_bins - 1; i++){
+            if (left_count[i] == 0 || right_count[i] == 0) continue;
+            float cost = left_count[i] * left_area[i] + right_count[i] * right_area[i];
+            if (cost < best.cost){
+                best.axis = axis;
+                best.bin = i;
+                best.cost = cost;
+                best.c_min = c_min[axis];
+                best.scale = scale[axis];
+                best.left_box = left_boxes[i];
+                best.right_box = right_boxes[i];
+            }
+        }
+    }
+
+    // normalize to the probability of hitting the children given the parent was hit
+    float parent_area = node.box.area();
+    if (best.axis >= 0 && parent_area > 0.f){
+        best.cost = traversal_cost + intersection_cost * best.cost / parent_area;
+    }
+
+    return best;
+}
+
+unsigned BVH::partition(unsigned first, unsigned count, const Split& split,
+    const std::vector<glm::vec3>& centroids)
+{
+    auto goes_left = [&](unsigned idx){
+        return bin_index(centroids[idx], split.axis, split.c_min, split.scale) <= split.bin;
+    };
+
+    if (count < parallel_min_size){
+        auto begin = indices.begin() + first;
+        return std::partition(begin, begin + count, goes_left) - begin;
+    }
+
+    // count the left side of every chunk, then scatter each chunk to its
+    // offsets on both sides of the split
+    const unsigned chunk_size = 2048;
+    unsigned num_chunks = (count + chunk_size - 1) / chunk_size;
+    std::vector<unsigned> left_offsets(num_chunks + 1, 0);
+    tbb::parallel_for(0u, num_chunks, [&](unsigned c){
+        unsigned end = std::min(count, (c + 1) * chunk_size);
+        for (unsigned i = c * chunk_size; i < end; i++){
+            left_offsets[c + 1] += goes_left(indices[first + i]);
+        }
+    });
+    for (unsigned c = 0; c < num_chunks; c++) left_offsets[c + 1] += left_offsets[c];
+
+    unsigned total_left = left_offsets[num_chunks];
+    std::vector<unsigned> sorted(count);
+    tbb::parallel_for(0u, num_chunks, [&](unsigned c){
+        unsigned left = left_offsets[c];
+        unsigned right = total_left + c * chunk_size - left_offsets[c];
+        unsigned end = std::min(count, (c + 1) * chunk_size);
+        for (unsigned i = c * chunk_size; i < end; i++){
+            auto idx = indices[first + i];
+            sorted[goes_left(idx) ? left++ : right++] = idx;
+        }
+    });
+    tbb::parallel_for(tbb::blocked_range<unsigned>(0, count, chunk_size), [&](const tbb::blocked_range<unsigned>& range){
+        std::copy(sorted.begin() + range.begin(), sorted.begin() + range.end(), indices.begin() + first + range.begin());
+    });
+
+    return total_left;
+}
+
+void BVH::subdivide(unsigned node_idx, unsigned depth, const std::vector<AABB>& prim_bounds,
+    const std::vector<glm::vec3>& centroids, std::atomic<unsigned>& node_count)
+{
+    Node& node = nodes[node_idx];
+    if (node.count <= 1 || depth >= max_depth) return;
+
+    auto split = findBestSplit(node, prim_bounds, centroids);
+    float leaf_cost = intersection_cost * node.count;
+    if (split.cost >= leaf_cost && node.count <= max_leaf_size) return;
+
+    unsigned first = node.left_first;
+    unsigned count = node.count;
+    unsigned left = node_count.fetch_add(2);
+
+    if (split.axis >= 0){
+        // the bins already hold the exact bounds of both sides
+        unsigned left_count = partition(first, count, split, centroids);
+        nodes[left].box = split.left_box;
+        nodes[left + 1].box = split.right_box;
+        nodes[left].count = left_count;
+    }
+    else{
+        // all centroids coincide, any split of the range is as good as another
+        nodes[left].count = count / 2;
+        nodes[left].box = computeBounds(first, count / 2, prim_bounds);
+        nodes[left + 1].box = computeBounds(first + count / 2, count - count / 2, prim_bounds);
+    }
+    nodes[left].left_first = first;
+    nodes[left + 1].left_first = first + nodes[left].count;
+    nodes[left + 1].count = count - nodes[left].count;
+    node.left_first = left;
+    node.count = 0;
+
+    if (count >= parallel_min_size){
+        tbb::parallel_invoke(
+            [&]{ subdivide(left, depth + 1, prim_bounds, centroids, node_count); },
+            [&]{ subdivide(left + 1, depth + 1, prim_bounds, centroids, node_count); });
+    }
+    else{
+        subdivide(left, depth + 1, prim_bounds, centroids, node_count);
+        subdivide(left + 1, depth + 1, prim_bounds, centroids, node_count);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------
+// ref: Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", 2012
+
+// spreads the low 21 bits of v so that two zero bits follow each of them
+static uint64_t expand_bits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+void BVH::mortonSort(const std::vector<glm::vec3>& points, std::vector<unsigned>& order, std::vector<uint64_t>& codes)
+{
+    unsigned n = points.size();
+    AABB point_bounds;
+    reduce_range(0, n, point_bounds,
+        [&](unsigned begin, unsigned end, AABB& box){
+            for (unsigned i = begin; i < end; i++) box.grow(points[i]);
+        },
+        [](AABB a, const AABB& b){ a.grow(b); return a; });
+
+    // 30 bit codes are plenty to tell a million primitives apart, larger
+    // meshes get the full 63 bits
+    const unsigned bits = n > (1u << 20) ? 21 : 10;
+    const float cells = static_cast<float>(1u << bits);
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++){
+        float extent = point_bounds.max[axis] - point_bounds.min[axis];
+        scale[axis] = extent > 0.f ? cells / extent : 0.f;
+    }
+
+    std::vector<std::pair<uint64_t, unsigned>> keys(n);
+    tbb::parallel_for(tbb::blocked_range<unsigned>(0, n, 4096), [&](const tbb::blocked_range<unsigned>& range){
+        for (unsigned i = range.begin(); i != range.end(); i++){
+            uint64_t code = 0;
+            for (int axis = 0; axis < 3; axis++){
+                float cell = (points[i][axis] - point_bounds.min[axis]) * scale[axis];
+                uint64_t q = static_cast<uint64_t>(std::min(std::max(cell, 0.f), cells - 1.f));
+                code |= expand_bits(q) << axis;
+            }
+            keys[i] = {code, i};
+        }
+    });
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    order.resize(n);
+    codes.resize(n);
+    for (unsigned i = 0; i < n; i++){
+        codes[i] = keys[i].first;
+        order[i] = keys[i].second;
+    }
+}
+
+void BVH::buildLinear(const std::vector<AABB>& prim_bounds, const std::vector<glm::vec3>& centroids)
+{
+    unsigned n = prim_bounds.size();
+    std::vector<uint64_t> codes;
+    mortonSort(centroids, indices, codes);
+
+    nodes.resize(2 * n - 1);
+    std::atomic<unsigned> node_count(1);
+    emitLinear(0, 0, n, 0, prim_bounds, codes, node_count);
+    nodes.resize(node_count);
+    nodes.shrink_to_fit();
+}
+
+void BVH::emitLinear(unsigned node_idx, unsigned first, unsigned count, unsigned depth,
+    const std::vector<AABB>& prim_bounds, const std::vector<uint64_t>& codes, std::atomic<unsigned>& node_count)
+{
+    Node& node = nodes[node_idx];
+    node.left_first = first;
+    node.count = count;
+    if (count <= linear_leaf_size || depth >= max_depth){
+        node.box = computeBounds(first, count, prim_bounds);
+        return;
+    }
+
+    // the range is sorted, so the first bit where its ends differ splits it
+    // in two, binary search for the last code with that bit cleared
+    unsigned last = first + count - 1;
+    unsigned left_count = count / 2;
+    uint64_t first_code = codes[first];
+    if (first_code != codes[last]){
+        int common_prefix = __builtin_clzll(first_code ^ codes[last]);
+        unsigned split = first, step = last - first;
+        do {
+            step = (step + 1) >> 1;
+            unsigned candidate = split + step;
+            if (candidate < last && __builtin_clzll(first_code ^ codes[candidate]) > common_prefix){
+                split = candidate;
+            }
+        } while (step > 1);
+        left_count = split - first + 1;
+    }
+
+    unsigned left = node_count.fetch_add(2);
+    if (count >= parallel_min_size){
+        tbb::parallel_invoke(
+            [&]{ emitLinear(left, first, left_count, depth + 1, prim_bounds, codes, node_count); },
+            [&]{ emitLinear(left + 1, first + left_count, count - left_count, depth + 1, prim_bounds, codes, node_count); });
+    }
+    else{
+        emitLinear(left, first, left_count, depth + 1, prim_bounds, codes, node_count);
+        emitLinear(left + 1, first + left_count, count - left_count, depth + 1, prim_bounds, codes, node_count);
+    }
+
+    node.box = nodes[left].box;
+    node.box.grow(nodes[left + 1].box);
+    node.left_first = left;
+    node.count = 0;
+}
+
+// ---------------------------------------------------------------------------------------------------
+// ref: Stich et al., "Spatial Splits in Bounding Volume Hierarchies", 2009
+
+// references are primitives clipped to the node they were pushed into,
+// they grow in number as spatial splits cut primitives in two
+struct BVH::SpatialBuild {
+    SplitFunction split_prim;
+    std::vector<AABB> ref_bounds;
+    std::vector<unsigned> ref_prims;
+    size_t max_refs;
+    float min_overlap;
+};
+
+void BVH::buildSpatial(const std::vector<AABB>& prim_bounds, const SplitFunction& split_prim)
+{
+    unsigned n = prim_bounds.size();
+    SpatialBuild build;
+    build.split_prim = split_prim ? split_prim :
+        [](unsigned, int axis, float position, const AABB& box, AABB& left, AABB& right){
+            left = right = box;
+            left.max[axis] = std::min(left.max[axis], position);
+            right.min[axis] = std::max(right.min[axis], position);
+        };
+    build.ref_bounds = prim_bounds;
+    build.ref_prims.resize(n);
+    for (unsigned i = 0; i < n; i++) build.ref_prims[i] = i;
+    build.max_refs = n + static_cast<size_t>(max_reference_growth * n);
+
+    nodes.reserve(2 * build.max_refs);
+    nodes.resize(1);
+    nodes[0].box = computeBounds(0, n, prim_bounds);
+    build.min_overlap = min_spatial_overlap * nodes[0].box.area();
+
+    indices.clear();
+    std::vector<unsigned> refs(n);
+    for (unsigned i = 0; i < n; i++) refs[i] = i;
+    subdivideSpatial(0, refs, 0, build);
+    nodes.shrink_to_fit();
+    indices.shrink_to_fit();
+}
+
+void BVH::subdivideSpatial(unsigned node_idx, std::vector<unsigned>& refs, unsigned depth, SpatialBuild& build)
+{
+    auto& ref_bounds = build.ref_bounds;
+    unsigned count = refs.size();
+    AABB node_box = nodes[node_idx].box;
+
+    auto make_leaf = [&]{
+        nodes[node_idx].left_first = indices.size();
+        nodes[node_idx].count = count;
+        for (auto ref : refs) indices.push_back(build.ref_prims[ref]);
+    };
+    if (count <= 1 || depth >= max_depth){
+        make_leaf();
+        return;
+    }
+
+    // object split, binned by the centroids of the references
+    AABB centroid_bounds;
+    for (auto ref : refs) centroid_bounds.grow(ref_bounds[ref].centroid());
+
+    Split object;
+    for (int axis = 0; axis < 3; axis++){
+        float c_min = centroid_bounds.min[axis];
+        float extent = centroid_bounds.max[axis] - c_min;
+        if (extent <= 0.f) continue;
+        float scale = num_bins / extent;
+
+        AABB bin_box[num_bins];
+        unsigned bin_count[num_bins] = {};
+        for (auto ref : refs){
+            int bin = bin_index(ref_bounds[ref].centroid(), axis, c_min, scale);
+            bin_count[bin]++;
+            bin_box[bin].grow(ref_bounds[ref]);
+        }
+
+        AABB right_boxes[num_bins - 1], right_box;
+        unsigned right_count[num_bins - 1], right_sum = 0;
+        for (int i = num_bins - 1; i > 0; i--){
+            right_sum += bin_count[i];
+            right_box.grow(bin_box[i]);
+            right_count[i - 1] = right_sum;
+            right_boxes[i - 1] = right_box;
+        }
+        AABB left_box;
+        unsigned left_sum = 0;
+        for (int i = 0; i < num_bins - 1; i++){
+            left_sum += bin_count[i];
+            left_box.grow(bin_box[i]);
+            if (left_sum == 0 || right_count[i] == 0) continue;
+            float cost = left_sum * left_box.area() + right_count[i] * right_boxes[i].area();
+            if (cost < object.cost){
+                object.axis = axis;
+                object.bin = i;
+                object.cost = cost;
+                object.c_min = c_min;
+                object.scale = scale;
+                object.left_box = left_box;
+                object.right_box = right_boxes[i];
+            }
+        }
+    }
+
+    // spatial split, binned by position over the node box with every
+    // reference clipped into the bins it spans. Only worth it where the
+    // object split leaves the children overlapping, and while the
+    // reference budget lasts.
+    int spatial_axis = -1;
+    float spatial_cost = INFINITY, spatial_position = 0.f;
+    bool try_spatial = ref_bounds.size() < build.max_refs &&
+        (object.axis < 0 || object.left_box.clip(object.right_box).area() > build.min_overlap);
+    for (int axis = 0; try_spatial && axis < 3; axis++){
+        float b_min = node_box.min[axis];
+        float bin_width = (node_box.max[axis] - b_min) / num_bins;
+        if (bin_width <= 0.f) continue;
+        auto plane = [&](int i){ return b_min + (i + 1) * bin_width; };
+        auto bin_of = [&](float p){
+            return std::max(0, std::min(num_bins - 1, static_cast<int>((p - b_min) / bin_width)));
+        };
+
+        AABB bin_box[num_bins];
+        unsigned entries[num_bins] = {}, exits[num_bins] = {};
+        for (auto ref : refs){
+            const AABB& box = ref_bounds[ref];
+            int first = bin_of(box.min[axis]), last = bin_of(box.max[axis]);
+            entries[first]++;
+            exits[last]++;
+            AABB rest = box, left, right;
+            for (int i = first; i < last; i++){
+                build.split_prim(build.ref_prims[ref], axis, plane(i), rest, left, right);
+                bin_box[i].grow(left);
+                rest = right;
+            }
+            bin_box[last].grow(rest);
+        }
+
+        AABB right_boxes[num_bins - 1], right_box;
+        unsigned right_count[num_bins - 1], right_sum = 0;
+        for (int i = num_bins - 1; i > 0; i--){
+            right_sum += exits[i];
+            right_box.grow(bin_box[i]);
+            right_count[i - 1] = right_sum;
+            right_boxes[i - 1] = right_box;
+        }
+        AABB left_box;
+        unsigned left_sum = 0;
+        for (int i = 0; i < num_bins - 1; i++){
+            left_sum += entries[i];
+            left_box.grow(bin_box[i]);
+            // duplicating every reference into both children would not make progress
+            if (left_sum == 0 || right_count[i] == 0 || (left_sum == count && right_count[i] == count)) continue;
+            float cost = left_sum * left_box.area() + right_count[i] * right_boxes[i].area();
+            if (cost < spatial_cost){
+                spatial_axis = axis;
+                spatial_cost = cost;
+                spatial_position = plane(i);
+            }
+        }
+    }
+
+    float parent_area = node_box.area();
+    auto normalize = [&](float cost){
+        return parent_area > 0.f ? traversal_cost + intersection_cost * cost / parent_area : cost;
+    };
+    float leaf_cost = intersection_cost * count;
+    float best_cost = std::min(normalize(object.cost), normalize(spatial_cost));
+    if (best_cost >= leaf_cost && count <= max_leaf_size){
+        make_leaf();
+        return;
+    }
+
+    std::vector<unsigned> left_refs, right_refs;
+    if (spatial_axis >= 0 && spatial_cost < object.cost){
+        int axis = spatial_axis;
+        for (auto ref : refs){
+            const AABB box = ref_bounds[ref];
+            if (box.max[axis] <= spatial_position){
+                left_refs.push_back(ref);
+                continue;
+            }
+            if (box.min[axis] >= spatial_position){
+                right_refs.push_back(ref);
+                continue;
+            }
+
+            AABB left, right;
+            build.split_prim(build.ref_prims[ref], axis, spatial_position, box, left, right);
+            bool straddles = !left.isEmpty() && !right.isEmpty();
+            if (straddles && ref_bounds.size() < build.max_refs){
+                ref_bounds[ref] = left;
+                left_refs.push_back(ref);
+                right_refs.push_back(ref_bounds.size());
+                ref_bounds.push_back(right);
+                build.ref_prims.push_back(build.ref_prims[ref]);
+            }
+            // out of budget, or the primitive only touches the plane
+            else if (right.isEmpty() || (!left.isEmpty() && box.centroid()[axis] < spatial_position)){
+                left_refs.push_back(ref);
+            }
+            else right_refs.push_back(ref);
+        }
+    }
+    else if (object.axis >= 0){
+        for (auto ref : refs){
+            bool left = bin_index(ref_bounds[ref].centroid(), object.axis, object.c_min, object.scale) <= object.bin;
+            (left ? left_refs : right_refs).push_back(ref);
+        }
+    }
+    if (left_refs.empty() || right_refs.empty()){
+        // all centroids coincide, any split of the range is as good as another
+        left_refs.assign(refs.begin(), refs.begin() + count / 2);
+        right_refs.assign(refs.begin() + count / 2, refs.end());
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+
+    // children are adjacent, the node array may move while they are built
+    unsigned left = nodes.size();
+    nodes.resize(left + 2);
+    nodes[node_idx].left_first = left;
+    nodes[node_idx].count = 0;
+    for (unsigned c = 0; c < 2; c++){
+        AABB box;
+        for (auto ref : c == 0 ? left_refs : right_refs) box.grow(ref_bounds[ref]);
+        nodes[left + c].box = box.clip(node_box);
+    }
+
+    subdivideSpatial(left, left_refs, depth + 1, build);
+    subdivideSpatial(left + 1, right_refs, depth + 1, build);
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+void BVH::linkParents()
+{
+    parents.assign(nodes.size(), 0);
+    prim_leaves.resize(indices.size());
+    area_cost = 0.0;
+    for (unsigned i = 0; i < nodes.size(); i++){
+        const Node& node = nodes[i];
+        area_cost += sahWeight(node) * static_cast<double>(node.box.area());
+        if (node.isLeaf()){
+            for (unsigned j = node.left_first; j < node.left_first + node.count; j++){
+                prim_leaves[indices[j]] = i;
+            }
+        }
+        else{
+            parents[node.left_first] = i;
+            parents[node.left_first + 1] = i;
+        }
+    }
+}
+
+void BVH::refit(const std::vector<AABB>& prim_bounds, const std::vector<unsigned>& changed)
+{
+    if (nodes.empty()) return;
+    if (parents.empty()){
+        linkParents();
+        // once more, noting the slot every node ends up in
+        collapse();
+    }
+
+    // the cost changes by the weighted area each refitted box gains or loses
+    auto set_box = [&](unsigned node_idx, const AABB& box){
+        Node& node = nodes[node_idx];
+        area_cost += sahWeight(node) * (static_cast<double>(box.area()) - node.box.area());
+        node.box = box;
+        refitWideSlot(node_idx);
+    };
+
+    for (unsigned prim: changed){
+        unsigned node_idx = prim_leaves[prim];
+        set_box(node_idx, computeBounds(nodes[node_idx].left_first, nodes[node_idx].count, prim_bounds));
+
+        // once a box comes out unchanged the path above it is up to date,
+        // other changed primitives below it are refitted on their own
+        while (node_idx != 0){
+            node_idx = parents[node_idx];
+            Node& node = nodes[node_idx];
+            AABB box = nodes[node.left_first].box;
+            box.grow(nodes[node.left_first + 1].box);
+            if (box.min == node.box.min && box.max == node.box.max) break;
+            set_box(node_idx, box);
+        }
+    }
+}
+
+void BVH::refitWideSlot(unsigned node_idx)
+{
+    // nodes opened into the wide node of an ancestor, and the root, have no slot
+    unsigned slot = wide_slots[node_idx];
+    if (slot == ~0u) return;
+
+    WideNode& wide = wide_nodes[slot / width];
+    for (int axis = 0; axis < 3; axis++){
+        wide.bounds[axis][slot % width] = nodes[node_idx].box.min[axis];
+        wide.bounds[axis + 3][slot % width] = nodes[node_idx].box.max[axis];
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------
+// ref: Wald et al., "Getting Rid of Packets", 2008
+
+void BVH::collapse()
+{
+    wide_nodes.clear();
+    wide_slots.clear();
+    if (nodes.empty()) return;
+    // only refitted hierarchies need to find their nodes in the wide ones
+    if (!parents.empty()) wide_slots.assign(nodes.size(), ~0u);
+
+    // pairs of binary node and the wide node taking over its subtree
+    std::vector<std::pair<unsigned, unsigned>> stack = {{0, 0}};
+    wide_nodes.emplace_back();
+    while (!stack.empty()){
+        auto entry = stack.back();
+        stack.pop_back();
+
+        unsigned children[width];
+        int n = 0;
+        const Node& root = nodes[entry.first];
+        if (root.isLeaf()) children[n++] = entry.first;
+        else{
+            children[n++] = root.left_first;
+            children[n++] = root.left_first + 1;
+        }
+
+        // pull the grandchildren up in place of the largest interior child until the node is full
+        while (n < width){
+            int largest = -1;
+            for (int i = 0; i < n; i++){
+                const Node& child = nodes[children[i]];
+                if (child.isLeaf()) continue;
+                if (largest < 0 || child.box.area() > nodes[children[largest]].box.area()) largest = i;
+            }
+            if (largest < 0) break;
+
+            unsigned opened = children[largest];
+            children[largest] = nodes[opened].left_first;
+            children[n++] = nodes[opened].left_first + 1;
+        }
+
+        WideNode node = {};
+        node.num_children = n;
+        for (int i = 0; i < n; i++){
+            const Node& child = nodes[children[i]];
+            if (!wide_slots.empty()) wide_slots[children[i]] = entry.second * width + i;
+            for (int axis = 0; axis < 3; axis++){
+                node.bounds[axis][i] = child.box.min[axis];
+                node.bounds[axis + 3][i] = child.box.max[axis];
+            }
+            if (child.isLeaf()){
+                node.child[i] = child.left_first;
+                node.count[i] = child.count;
+            }
+            else{
+                node.child[i] = wide_nodes.size();
+                stack.push_back({children[i], node.child[i]});
+                wide_nodes.emplace_back();
+            }
+        }
+        wide_nodes[entry.second] = node;
+    }
+}
+
+float BVH::getSAHCost() const
+{
+    // before the first refit there is no running sum to go by
+    float root_area = nodes.empty() ? 0.f : nodes[0].box.area();
+    if (parents.empty() || root_area <= 0.f) return getStats().sah_cost;
+    return static_cast<float>(area_cost / root_area);
+}
+
+BVH::Stats BVH::getStats() const
+{
+    Stats stats;
+    if (nodes.empty()) return stats;
+
+    float root_area = nodes[0].box.area();
+    std::vector<std::pair<unsigned, unsigned>> stack = {{0, 0}};
+    while (!stack.empty()){
+        auto entry = stack.back();
+        stack.pop_back();
+
+        const Node& node = nodes[entry.first];
+        float hit_probability = root_area > 0.f ? node.box.area() / root_area : 1.f;
+        stats.nodes++;
+        stats.max_depth = std::max(stats.max_depth, entry.second);
+
+        if (node.isLeaf()){
+            stats.leaves++;
+            stats.max_leaf_size = std::max(stats.max_leaf_size, node.count);
+            stats.avg_leaf_size += node.count;
+            stats.sah_cost += intersection_cost * node.count * hit_probability;
+        }
+        else{
+            stats.sah_cost += traversal_cost * hit_probability;
+            stack.push_back({node.left_first, entry.second + 1});
+            stack.push_back({node.left_first + 1, entry.second + 1});
+        }
+    }
+    stats.avg_leaf_size /= stats.leaves;
+    stats.references = indices.size();
+
+    return stats;
+}
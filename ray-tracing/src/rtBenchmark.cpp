@@ -0,0 +1,253 @@
+#include "rtBenchmark.h"
+
+static float rmse(const ofPixels& image, const ofPixels& reference)
+{
+    double sum = 0.0;
+    size_t n = image.size();
+    for (size_t i = 0; i < n; i++){
+        double diff = static_cast<double>(image[i]) - reference[i];
+        sum += diff * diff;
+    }
+    return n ? std::sqrt(sum / n) : 0.f;
+}
+
+std::vector<ConvergenceSample> benchmarkSamplers(RayTracer& raytracer, int width, int height,
+    int max_spp, int reference_spp, bool parallel)
+{
+    std::vector<ConvergenceSample> results;
+    auto saved_settings = raytracer.settings;
+
+    ofPixels reference, image;
+    reference.allocate(width, height, OF_PIXELS_RGB);
+    image.allocate(width, height, OF_PIXELS_RGB);
+
+    raytracer.settings.sampler = UNIFORM;
+    raytracer.settings.samples_per_pixel = reference_spp;
+    raytracer.render(reference, parallel);
+
+    const SamplerType samplers[] = {UNIFORM, HALTON, SOBOL, BLUE_NOISE};
+    for (auto sampler: samplers){
+        for (int spp = 1; spp <= max_spp; spp *= 2){
+            raytracer.settings.sampler = sampler;
+            raytracer.settings.samples_per_pixel = spp;
+            float time = raytracer.render(image, parallel);
+            results.push_back({sampler, spp, rmse(image, reference), time});
+        }
+    }
+
+    raytracer.settings = saved_settings;
+    return results;
+}
+
+void logConvergence(const std::vector<ConvergenceSample>& results)
+{
+    for (const auto& result: results){
+        ofLogNotice("benchmarkSamplers") << Sampler::getName(result.sampler) << " "
+            << result.samples_per_pixel << " spp: RMSE " << result.rmse
+            << ", " << result.render_time << " s";
+    }
+}
+
+static LayoutSample traceLayout(const char* layout, const Model& model, const std::vector<Ray>& rays)
+{
+    int hits = 0;
+    auto start = Clock::now();
+    for (const auto& ray: rays){
+        Intersection isect;
+        hits += model.intersect(ray, INFINITY, isect);
+    }
+    float seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+    float bytes = static_cast<float>(model.memoryUsage()) / std::max<size_t>(model.triangles.size(), 1);
+    return {layout, bytes, rays.size() / seconds / 1e+6f, hits};
+}
+
+std::vector<LayoutSample> benchmarkCompression(const Model& model, int num_rays)
+{
+    // rays from a sphere around the mesh towards random points of its bounds
+    auto bounds = model.getBounds();
+    auto center = bounds.centroid();
+    float radius = vec_length(subtract_vecs(bounds.max, bounds.min));
+    PCG32 rng(num_rays, 7);
+    auto inside = [&]{
+        return glm::vec3(bounds.min[0] + rng.uniform() * (bounds.max[0] - bounds.min[0]),
+            bounds.min[1] + rng.uniform() * (bounds.max[1] - bounds.min[1]),
+            bounds.min[2] + rng.uniform() * (bounds.max[2] - bounds.min[2]));
+    };
+
+    std::vector<Ray> rays(num_rays);
+    for (auto& ray: rays){
+        float z = 2.f * rng.uniform() - 1.f, phi = 2.f * M_PI * rng.uniform();
+        float r = std::sqrt(std::max(0.f, 1.f - z * z));
+        auto origin = add_vecs(center, scale_vec(radius, glm::vec3(r * std::cos(phi), r * std::sin(phi), z)));
+        ray = Ray(origin, normalize(subtract_vecs(inside(), origin)));
+    }
+
+    std::vector<LayoutSample> results;
+    results.push_back(traceLayout("float", model, rays));
+
+    Model copy = model;
+    if (copy.compress()) results.push_back(traceLayout("compressed", copy, rays));
+    else ofLogWarning("benchmarkCompression") << "leaves too large to compress";
+
+    return results;
+}
+
+void logLayouts(const std::vector<LayoutSample>& results)
+{
+    for (const auto& result: results){
+        ofLogNotice("benchmarkCompression") << result.layout << ": " << result.bytes_per_triangle
+            << " bytes per triangle, " << result.mrays_per_second << " Mrays/s, " << result.hits << " hits";
+    }
+}
+
+// random point of the cube [-1, 1]^3 and random direction
+static glm::vec3 random_point(PCG32& rng)
+{
+    return glm::vec3(2.f * rng.uniform() - 1.f, 2.f * rng.uniform() - 1.f, 2.f * rng.uniform() - 1.f);
+}
+
+static glm::vec3 random_direction(PCG32& rng)
+{
+    float z = 2.f * rng.uniform() - 1.f, phi = 2.f * M_PI * rng.uniform();
+    float r = std::sqrt(std::max(0.f, 1.f - z * z));
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// make(rng) returns a random object within the cube, every ray is cast from
+// a sphere around the cube toward one of its points. The rays are tested in
+// packets, each against one object, once ray by ray with its intersect and
+// once with its intersectPacket.
+template<typename Make>
+static KernelCheck checkKernel(const char* primitive, int num_rays, Make&& make)
+{
+    const int objects = 256, size = RayPacket::max_size;
+    PCG32 rng(num_rays, 11);
+    std::vector<decltype(make(rng))> prims;
+    for (int i = 0; i < objects; i++) prims.push_back(make(rng));
+
+    int num_packets = num_rays / size;
+    num_rays = num_packets * size;
+    std::vector<Ray> rays(num_rays);
+    std::vector<RayPacket> packets(num_packets);
+    for (int r = 0; r < num_rays; r++){
+        auto origin = scale_vec(3.f, random_direction(rng));
+        rays[r] = Ray(origin, normalize(subtract_vecs(random_point(rng), origin)));
+        packets[r / size].add(rays[r]);
+    }
+
+    std::vector<Intersection> scalar(num_rays), batched(num_rays);
+    auto start = Clock::now();
+    for (int r = 0; r < num_rays; r++) prims[(r / size) % objects].intersect(rays[r], INFINITY, scalar[r]);
+    float scalar_seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+    float t_max[size];
+    std::fill(t_max, t_max + size, INFINITY);
+    std::vector<RayMask> hits(num_packets);
+    start = Clock::now();
+    for (int p = 0; p < num_packets; p++){
+        hits[p] = prims[p % objects].intersectPacket(packets[p], packets[p].all(), t_max, &batched[p * size]);
+    }
+    float batched_seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+    KernelCheck check = {primitive, num_rays, 0, 0, 0.f, num_rays / scalar_seconds / 1e+6f, num_rays / batched_seconds / 1e+6f};
+    for (int r = 0; r < num_rays; r++){
+        bool hit = scalar[r].obj != nullptr;
+        check.hits += hit;
+        if (hit != static_cast<bool>((hits[r / size] >> (r % size)) & 1)) check.mismatches++;
+        else if (hit) check.max_error = std::max(check.max_error, std::abs(batched[r].t - scalar[r].t) / scalar[r].t);
+    }
+    return check;
+}
+
+// the same random spheres as a SphereCloud and as Sphere objects, the cloud
+// against a loop over every sphere. The hit spheres are told apart by their
+// center and radius, the cloud reorders its spheres when it is built.
+static KernelCheck checkSphereCloud(int num_rays, int num_spheres)
+{
+    const ofFloatColor color(1, 1, 1, 1);
+    PCG32 rng(num_rays, 13);
+    SphereCloud cloud(0.5f, color);
+    std::vector<Sphere> spheres;
+    std::vector<glm::vec3> centers;
+    std::vector<float> radii;
+    float radius = 0.5f / std::cbrt(static_cast<float>(num_spheres));
+    for (int i = 0; i < num_spheres; i++){
+        auto center = random_point(rng);
+        float r = radius * (0.5f + rng.uniform());
+        cloud.add(center, r);
+        spheres.emplace_back(r, center, 0.5f, color);
+        centers.push_back(center);
+        radii.push_back(r);
+    }
+    cloud.build();
+
+    std::vector<Ray> rays(num_rays);
+    for (auto& ray: rays){
+        auto origin = scale_vec(3.f, random_direction(rng));
+        ray = Ray(origin, normalize(subtract_vecs(random_point(rng), origin)));
+    }
+
+    std::vector<Intersection> scalar(num_rays), batched(num_rays);
+    std::vector<int> nearest(num_rays, -1);
+    auto start = Clock::now();
+    for (int r = 0; r < num_rays; r++){
+        float t_max = INFINITY;
+        for (int i = 0; i < num_spheres; i++){
+            if (spheres[i].intersect(rays[r], t_max, scalar[r])){
+                t_max = scalar[r].t;
+                nearest[r] = i;
+            }
+        }
+    }
+    float scalar_seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+    start = Clock::now();
+    for (int r = 0; r < num_rays; r++) cloud.intersect(rays[r], INFINITY, batched[r]);
+    float batched_seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+    KernelCheck check = {"sphere cloud", num_rays, 0, 0, 0.f, num_rays / scalar_seconds / 1e+6f, num_rays / batched_seconds / 1e+6f};
+    for (int r = 0; r < num_rays; r++){
+        bool hit = nearest[r] >= 0;
+        check.hits += hit;
+        if (hit != (batched[r].obj != nullptr)) check.mismatches++;
+        else if (hit){
+            unsigned lane = batched[r].prim;
+            if (cloud.lanes.getCenter(lane) != centers[nearest[r]] || cloud.lanes.radius[lane] != radii[nearest[r]]) check.mismatches++;
+            else check.max_error = std::max(check.max_error, std::abs(batched[r].t - scalar[r].t) / scalar[r].t);
+        }
+    }
+    return check;
+}
+
+std::vector<KernelCheck> checkQuadricKernels(int num_rays)
+{
+    const ofFloatColor color(1, 1, 1, 1);
+    std::vector<KernelCheck> results;
+    results.push_back(checkKernel("cone", num_rays, [&](PCG32& rng){
+        auto apex = random_point(rng);
+        auto base = add_vecs(apex, scale_vec(0.2f + 0.8f * rng.uniform(), random_direction(rng)));
+        return Cone(apex, base, 0.1f + 0.5f * rng.uniform(), 0.5f, color);
+    }));
+    results.push_back(checkKernel("cylinder", num_rays, [&](PCG32& rng){
+        auto bottom = random_point(rng);
+        auto top = add_vecs(bottom, scale_vec(0.2f + 0.8f * rng.uniform(), random_direction(rng)));
+        return Cylinder(top, bottom, 0.05f + 0.25f * rng.uniform(), 0.5f, color);
+    }));
+    // every ray is tested against every sphere, so far fewer of them
+    results.push_back(checkSphereCloud(num_rays / 64, 4096));
+    return results;
+}
+
+bool logKernelChecks(const std::vector<KernelCheck>& results)
+{
+    bool agree = true;
+    for (const auto& result: results){
+        ofLogNotice("checkQuadricKernels") << result.primitive << ": " << result.hits << " hits of " << result.rays
+            << " rays, " << result.mismatches << " mismatches, max relative error " << result.max_error
+            << ", scalar " << result.scalar_mrays_per_second << " Mrays/s, batched "
+            << result.batched_mrays_per_second << " Mrays/s";
+        agree = agree && result.mismatches == 0 && result.max_error == 0.f;
+    }
+    return agree;
+}
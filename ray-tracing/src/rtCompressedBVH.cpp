@@ -0,0 +1,98 @@
+#include "rtCompressedBVH.h"
+
+// smallest power of two grid spacing fitting extent into 255 steps
+static int grid_exponent(float extent)
+{
+    int e = extent > 0.f ? static_cast<int>(std::ceil(std::log2(extent / 255.f))) : -126;
+    while (e < 127 && std::ldexp(255.f, e) < extent) e++;
+    return std::max(-126, std::min(127, e));
+}
+
+bool CompressedBVH::build(const BVH& bvh, const std::vector<Triangle>& triangles, const std::vector<glm::vec3>& vertices)
+{
+    nodes.clear();
+    blocks.clear();
+    if (bvh.wide_nodes.empty()) return true;
+
+    mesh_bounds = bvh.nodes[0].box;
+    for (int axis = 0; axis < 3; axis++){
+        vertex_scale[axis] = (mesh_bounds.max[axis] - mesh_bounds.min[axis]) / 65535.f;
+    }
+    auto quantize = [&](const glm::vec3& p, uint16_t* q){
+        for (int axis = 0; axis < 3; axis++){
+            float cell = vertex_scale[axis] > 0.f ? (p[axis] - mesh_bounds.min[axis]) / vertex_scale[axis] : 0.f;
+            q[axis] = static_cast<uint16_t>(std::min(std::max(std::round(cell), 0.f), 65535.f));
+        }
+    };
+
+    // interior children of a wide node are allocated next to each other,
+    // so the wide node indices carry over as they are
+    nodes.resize(bvh.wide_nodes.size());
+    blocks.reserve(bvh.indices.size());
+    for (size_t i = 0; i < bvh.wide_nodes.size(); i++){
+        const auto& wide = bvh.wide_nodes[i];
+        Node& node = nodes[i];
+        node = Node();
+        node.num_children = wide.num_children;
+        node.child_base = 0;
+        node.triangle_base = blocks.size();
+
+        // the grid points of the vertices may stick out of their leaf boxes by
+        // up to half a cell, every box is grown by a full cell to keep them inside
+        AABB child_boxes[width], box;
+        for (unsigned c = 0; c < wide.num_children; c++){
+            for (int axis = 0; axis < 3; axis++){
+                child_boxes[c].min[axis] = wide.bounds[axis][c] - vertex_scale[axis];
+                child_boxes[c].max[axis] = wide.bounds[axis + 3][c] + vertex_scale[axis];
+            }
+            box.grow(child_boxes[c]);
+        }
+        node.origin = box.min;
+
+        for (int axis = 0; axis < 3; axis++){
+            int e = grid_exponent(box.max[axis] - box.min[axis]);
+            // the last grid point is rounded once more when added to the origin
+            while (e < 127 && node.origin[axis] + 255.f * std::ldexp(1.f, e) < box.max[axis]) e++;
+            node.exponent[axis] = static_cast<int8_t>(e);
+            float scale = std::ldexp(1.f, e);
+
+            // rounded outwards, then nudged until the decoded box holds the child
+            for (unsigned c = 0; c < wide.num_children; c++){
+                float lo = child_boxes[c].min[axis], hi = child_boxes[c].max[axis];
+                int q_lo = std::max(0, static_cast<int>(std::floor((lo - node.origin[axis]) / scale)));
+                int q_hi = std::min(255, static_cast<int>(std::ceil((hi - node.origin[axis]) / scale)));
+                while (q_lo > 0 && node.origin[axis] + q_lo * scale > lo) q_lo--;
+                while (q_hi < 255 && node.origin[axis] + q_hi * scale < hi) q_hi++;
+                node.q_min[axis][c] = q_lo;
+                node.q_max[axis][c] = q_hi;
+            }
+        }
+
+        bool first_interior = true;
+        for (unsigned c = 0; c < wide.num_children; c++){
+            if (wide.count[c] == 0){
+                if (first_interior) node.child_base = wide.child[c];
+                first_interior = false;
+                continue;
+            }
+            if (wide.count[c] > 255) return false;
+
+            node.count[c] = wide.count[c];
+            for (unsigned j = wide.child[c]; j < wide.child[c] + wide.count[c]; j++){
+                CompressedTriangle triangle;
+                triangle.prim = bvh.indices[j];
+                for (int k = 0; k < 3; k++){
+                    quantize(vertices[triangles[triangle.prim].vertices[k]], triangle.v[k]);
+                }
+                blocks.push_back(triangle);
+            }
+        }
+    }
+
+    return true;
+}
+
+size_t CompressedBVH::memoryUsage() const
+{
+    return nodes.size() * sizeof(Node) + blocks.size() * sizeof(CompressedTriangle);
+}
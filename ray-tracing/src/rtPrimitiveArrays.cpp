@@ -0,0 +1,47 @@
+#include "rtPrimitiveArrays.h"
+#include <typeinfo>
+
+void PrimitiveArrays::clear()
+{
+    planes.clear();
+    spheres.clear();
+    cones.clear();
+    cylinders.clear();
+    instances.clear();
+    others.clear();
+}
+
+// appends a copy of obj to objects, returning its reference
+template<typename T>
+static PrimitiveArrays::Ref append(std::vector<T>& objects, PrimitiveArrays::Type type, const Primitive& obj)
+{
+    objects.push_back(static_cast<const T&>(obj));
+    return {static_cast<uint32_t>(type), static_cast<uint32_t>(objects.size() - 1)};
+}
+
+PrimitiveArrays::Ref PrimitiveArrays::add(const Primitive& obj)
+{
+    // the classes with an array are final, so their exact type is enough
+    const auto& type = typeid(obj);
+    if (type == typeid(Plane)) return append(planes, PLANE, obj);
+    if (type == typeid(Sphere)) return append(spheres, SPHERE, obj);
+    if (type == typeid(Cone)) return append(cones, CONE, obj);
+    if (type == typeid(Cylinder)) return append(cylinders, CYLINDER, obj);
+    if (type == typeid(Instance)) return append(instances, INSTANCE, obj);
+
+    others.push_back(&obj);
+    return {static_cast<uint32_t>(OTHER), static_cast<uint32_t>(others.size() - 1)};
+}
+
+void PrimitiveArrays::update(Ref ref, const Primitive& obj)
+{
+    switch (ref.type){
+        case PLANE: planes[ref.index] = static_cast<const Plane&>(obj); break;
+        case SPHERE: spheres[ref.index] = static_cast<const Sphere&>(obj); break;
+        case CONE: cones[ref.index] = static_cast<const Cone&>(obj); break;
+        case CYLINDER: cylinders[ref.index] = static_cast<const Cylinder&>(obj); break;
+        case INSTANCE: instances[ref.index] = static_cast<const Instance&>(obj); break;
+        // kept by pointer, nothing to copy
+        default: break;
+    }
+}
@@ -1,4 +1,52 @@
 #include "rtPrimitives.h"
+#include "rtTransformation.h"
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+HitRecord Primitive::hit(const Ray& ray) const
+{
+    Intersection isect;
+    if (!intersect(ray, INFINITY, isect)) return HitRecord();
+
+    return getHitRecord(ray, isect);
+}
+
+RayMask Primitive::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    RayMask hits = 0;
+    for (; active; active &= active - 1){
+        int k = __builtin_ctzll(active);
+        if (intersect(packet.ray(k), t_max[k], isects[k])) hits |= RayMask(1) << k;
+    }
+    return hits;
+}
+
+RayMask Primitive::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    RayMask blocked = 0;
+    for (; active; active &= active - 1){
+        int k = __builtin_ctzll(active);
+        if (occluded(packet.ray(k), t_max[k])) blocked |= RayMask(1) << k;
+    }
+    return blocked;
+}
+
+// rays of active hitting at t[k] in [EPS, t_max[k]), recorded as hits on obj
+static inline RayMask record_hits(const float* t, RayMask active, const float* t_max, Intersection* isects, const Primitive* obj)
+{
+    RayMask hits = 0;
+    for (; active; active &= active - 1){
+        int k = __builtin_ctzll(active);
+        if (t[k] >= EPS && t[k] < t_max[k]){
+            isects[k].t = t[k];
+            isects[k].obj = obj;
+            hits |= RayMask(1) << k;
+        }
+    }
+    return hits;
+}
+
+// ---------------------------------------------------------------------------------------------------
 
 Plane::Plane(const glm::vec3& p, const glm::vec3& n, float spec_coef,const ofFloatColor& color):
     point(p), normal(n){
@@ -7,23 +55,56 @@ Plane::Plane(const glm::vec3& p, const glm::vec3& n, float spec_coef,const ofFlo
         reflect = true;
     }
 
-HitRecord Plane::hit(const Ray& ray) const
+bool Plane::intersect(const Ray& ray, float t_max, Intersection& isect) const
 {
     auto denom = dot_product(ray.d, normal); 
-    if (abs(denom) > EPS){
+    if (std::abs(denom) > EPS){
         auto po = subtract_vecs(point,ray.o);
         auto t = dot_product(po,normal) / denom;
-        if (t >= EPS){
-            auto p = ray.at(t);
-            auto alpha = denom > 0 ? -1:1;
-            auto norm = scale_vec(alpha, normal);
-
-            return HitRecord(true, t, p, norm, *this, ray);
+        if (t >= EPS && t < t_max){
+            isect.t = t;
+            isect.obj = this;
+            return true;
         }
     }
-    return HitRecord();
+    return false;
 }    
 
+HitRecord Plane::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    auto p = ray.at(isect.t);
+    auto alpha = dot_product(ray.d, normal) > 0 ? -1:1;
+    auto norm = scale_vec(alpha, normal);
+
+    return HitRecord(true, isect.t, p, norm, *this, ray);
+}
+
+bool Plane::occluded(const Ray& ray, float t_max) const
+{
+    Intersection isect;
+    return intersect(ray, t_max, isect);
+}
+
+// the distances of every lane are computed in one plain loop over the
+// packet, which vectorizes, with the same arithmetic as intersect
+RayMask Plane::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    float t[RayPacket::max_size];
+    for (int k = 0; k < packet.size; k++){
+        float denom = packet.d[0][k] * normal[0] + packet.d[1][k] * normal[1] + packet.d[2][k] * normal[2];
+        float dist = (point[0] - packet.o[0][k]) * normal[0] + (point[1] - packet.o[1][k]) * normal[1]
+            + (point[2] - packet.o[2][k]) * normal[2];
+        t[k] = std::abs(denom) > EPS ? dist / denom : -INFINITY;
+    }
+    return record_hits(t, active, t_max, isects, this);
+}
+
+RayMask Plane::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    Intersection isects[RayPacket::max_size];
+    return intersectPacket(packet, active, t_max, isects);
+}
+
 
 // ---------------------------------------------------------------------------------------------------
 
@@ -37,24 +118,67 @@ Sphere::Sphere(float r, const glm::vec3& c, float spec_coef,const ofFloatColor&
         reflect = true;
     }
 
-HitRecord Sphere::hit(const Ray& ray) const
+bool Sphere::intersect(const Ray& ray, float t_max, Intersection& isect) const
 {
     auto oc = subtract_vecs(ray.o, center);
     auto a = dot_product(ray.d, ray.d);
-    auto b = 2.0 * dot_product(oc, ray.d);
+    auto b = 2.f * dot_product(oc, ray.d);
     auto c = dot_product(oc, oc) - radius * radius;
 
     float t1, t2;
     if(solve_quadratic(a,b,c,t1,t2)){
         auto t = min_distance(t1, t2);
-        auto p = ray.at(t);
-        auto ip_center = subtract_vecs(p,center);
-        auto norm = scale_vec(1.0/radius, ip_center);
+        if (t >= EPS && t < t_max){
+            isect.t = t;
+            isect.obj = this;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+HitRecord Sphere::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    auto p = ray.at(isect.t);
+    auto ip_center = subtract_vecs(p,center);
+    auto norm = scale_vec(1.0/radius, ip_center);
+
+    return HitRecord(true, isect.t, p, norm, *this, ray);
+}
+
+bool Sphere::occluded(const Ray& ray, float t_max) const
+{
+    Intersection isect;
+    return intersect(ray, t_max, isect);
+}
 
-        return HitRecord(true, t, p, norm, *this, ray);
+RayMask Sphere::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    float t[RayPacket::max_size];
+    for (int k = 0; k < packet.size; k++){
+        float ox = packet.o[0][k] - center[0], oy = packet.o[1][k] - center[1], oz = packet.o[2][k] - center[2];
+        float dx = packet.d[0][k], dy = packet.d[1][k], dz = packet.d[2][k];
+        float a = dx * dx + dy * dy + dz * dz;
+        float b = 2.f * (ox * dx + oy * dy + oz * dz);
+        float c = (ox * ox + oy * oy + oz * oz) - radius * radius;
+
+        float t1, t2;
+        t[k] = solve_quadratic(a, b, c, t1, t2) ? min_distance(t1, t2) : -INFINITY;
     }
+    return record_hits(t, active, t_max, isects, this);
+}
 
-    return HitRecord();
+RayMask Sphere::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    Intersection isects[RayPacket::max_size];
+    return intersectPacket(packet, active, t_max, isects);
+}
+
+AABB Sphere::getBounds() const
+{
+    auto r = glm::vec3(std::abs(radius), std::abs(radius), std::abs(radius));
+    return AABB(subtract_vecs(center, r), add_vecs(center, r));
 }
 
 void Sphere::translate(const glm::mat4& m)
@@ -92,35 +216,76 @@ Cone::Cone(const glm::vec3& c, const glm::vec3& o, float a, float spec_coef, con
         reflect = false;
     }
 
-HitRecord Cone::hit(const Ray& ray) const
+bool Cone::intersect(const Ray& ray, float t_max, Intersection& isect) const
 {
     glm::vec3 co = subtract_vecs(ray.o, apex);
     auto dv = dot_product(ray.d, axis);
     auto cv = dot_product(co,axis);
     auto a = dv * dv - cosa * cosa;
-    auto b = 2.0 * (dv * cv - dot_product(ray.d, co) * cosa * cosa);
+    auto b = 2.f * (dv * cv - dot_product(ray.d, co) * cosa * cosa);
     auto c = cv * cv - dot_product(co,co)*cosa*cosa;
 
     float t1, t2;
     if(solve_quadratic(a,b,c,t1,t2)){
         auto t = min_distance(t1, t2);
-        if(t < EPS) return HitRecord();
+        // 0 / 0 for a ray along the surface, which misses it
+        if(!(t >= EPS && t < t_max)) return false;
 
-        auto p = ray.at(t);
-        auto cp = subtract_vecs(p,apex);
-        auto h = dot_product(cp,axis);
+        auto h = dot_product(subtract_vecs(ray.at(t),apex),axis);
+        if (h < EPS || h > height) return false;
 
-        if (h < EPS || h > height) return HitRecord();
+        isect.t = t;
+        isect.obj = this;
+        return true;
+    }
 
-        auto scale_factor = dot_product(axis,cp)/dot_product(cp,cp);
-        cp = scale_vec(scale_factor,cp);
-        auto norm = subtract_vecs(cp,axis);
-        norm = normalize(norm);
+    return false;
+}
 
-        return HitRecord(true, t, p, norm, *this, ray);
-    }
+HitRecord Cone::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    auto p = ray.at(isect.t);
+    auto cp = subtract_vecs(p,apex);
+    auto scale_factor = dot_product(axis,cp)/dot_product(cp,cp);
+    cp = scale_vec(scale_factor,cp);
+    auto norm = subtract_vecs(cp,axis);
+    norm = normalize(norm);
+
+    return HitRecord(true, isect.t, p, norm, *this, ray);
+}
 
-    return HitRecord();
+bool Cone::occluded(const Ray& ray, float t_max) const
+{
+    Intersection isect;
+    return intersect(ray, t_max, isect);
+}
+
+RayMask Cone::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    float t[RayPacket::max_size];
+    intersectConePacket(packet, apex, axis, cosa, height, t);
+    return record_hits(t, active, t_max, isects, this);
+}
+
+RayMask Cone::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    Intersection isects[RayPacket::max_size];
+    return intersectPacket(packet, active, t_max, isects);
+}
+
+AABB Cone::getBounds() const
+{
+    // the apex plus the base disk, whose extent along each world axis
+    // is radius * sin of the angle between that axis and the cone axis
+    float base_radius = height * tan(angle);
+    AABB box;
+    box.grow(apex);
+    for (int i = 0; i < 3; i++){
+        float extent = base_radius * sqrt(std::max(0.f, 1.f - axis[i] * axis[i]));
+        box.min[i] = std::min(box.min[i], center[i] - extent);
+        box.max[i] = std::max(box.max[i], center[i] + extent);
+    }
+    return box;
 }
 
 void Cone::rotate(const glm::mat4& m)
@@ -203,33 +368,70 @@ Cylinder::Cylinder(const glm::vec3& c1, const glm::vec3& c2, float r, float spec
         reflect = false;
     }
 
-HitRecord Cylinder::hit(const Ray& ray) const
+bool Cylinder::intersect(const Ray& ray, float t_max, Intersection& isect) const
 {
     auto co = subtract_vecs(ray.o,center_bottom);
     auto da = dot_product(ray.d,axis);
     auto ba = dot_product(co,axis);
 
     auto a = dot_product(ray.d,ray.d) - da*da;
-    auto b = 2.0 * (dot_product(ray.d,co) - (da*ba));
+    auto b = 2.f * (dot_product(ray.d,co) - (da*ba));
     auto c = dot_product(co,co) - (ba*ba) - radius * radius;
 
     float t1, t2;
     if(solve_quadratic(a,b,c,t1,t2)){
         auto t = min_distance(t1,t2);
-        if (t < EPS) return HitRecord();
-        auto p = ray.at(t);
-        auto cp = subtract_vecs(p,center_bottom);
-        auto h = dot_product(cp,axis);
-        if (h < EPS || h > height) return HitRecord();
-
-        auto temp = scale_vec(dot_product(cp,axis),axis);
-        auto norm = subtract_vecs(cp,temp);
-        norm = normalize(norm);
+        if (!(t >= EPS && t < t_max)) return false;
+        auto h = dot_product(subtract_vecs(ray.at(t),center_bottom),axis);
+        if (h < EPS || h > height) return false;
 
-        return HitRecord(true,t,p,norm,*this,ray);
+        isect.t = t;
+        isect.obj = this;
+        return true;
     }
     
-    return HitRecord();
+    return false;
+}
+
+HitRecord Cylinder::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    auto p = ray.at(isect.t);
+    auto cp = subtract_vecs(p,center_bottom);
+    auto temp = scale_vec(dot_product(cp,axis),axis);
+    auto norm = subtract_vecs(cp,temp);
+    norm = normalize(norm);
+
+    return HitRecord(true,isect.t,p,norm,*this,ray);
+}
+
+bool Cylinder::occluded(const Ray& ray, float t_max) const
+{
+    Intersection isect;
+    return intersect(ray, t_max, isect);
+}
+
+RayMask Cylinder::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    float t[RayPacket::max_size];
+    intersectCylinderPacket(packet, center_bottom, axis, radius, height, t);
+    return record_hits(t, active, t_max, isects, this);
+}
+
+RayMask Cylinder::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    Intersection isects[RayPacket::max_size];
+    return intersectPacket(packet, active, t_max, isects);
+}
+
+AABB Cylinder::getBounds() const
+{
+    AABB box;
+    for (int i = 0; i < 3; i++){
+        float extent = radius * sqrt(std::max(0.f, 1.f - axis[i] * axis[i]));
+        box.min[i] = std::min(center_top[i], center_bottom[i]) - extent;
+        box.max[i] = std::max(center_top[i], center_bottom[i]) + extent;
+    }
+    return box;
 }
 
 void Cylinder::rotate(const glm::mat4& m)
@@ -302,77 +504,511 @@ void Cylinder::reset()
 
 
 // ---------------------------------------------------------------------------------------------------
-Model::Model(const glm::vec3& p, const ofFloatColor& color): 
-    position(p){
+Model::Model(const ofFloatColor& color){
         this->color = color;
         reflect = false;
         use_precomputed = true;
     }
     
-HitRecord Model::hit(const Ray& ray) const
+std::vector<AABB> Model::getTriangleBounds() const
 {
-    //auto bound_record = bounding_sphere.hit(ray);
-    //if (!bound_record.hit) return HitRecord();
+    std::vector<AABB> triangle_bounds(triangles.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, triangles.size(), 4096), [&](const tbb::blocked_range<size_t>& range){
+        for (size_t i = range.begin(); i != range.end(); i++){
+            for (auto v: triangles[i].vertices){
+                triangle_bounds[i].grow(vertices[v]);
+            }
+        }
+    });
+    return triangle_bounds;
+}
 
-    auto bound_record = bbox.hit(ray);
-    if (!bound_record.hit) return HitRecord();
+void Model::build(BVHBuilder builder, bool with_blocks)
+{
+    // bounds of the triangle on both sides of the plane, from its vertices and
+    // the points where its edges cross the plane
+    auto split_triangle = [&](unsigned prim, int axis, float position, const AABB& box, AABB& left, AABB& right){
+        const auto& triangle = triangles[prim];
+        left = right = AABB();
+        for (int k = 0; k < 3; k++){
+            const auto& v0 = vertices[triangle.vertices[k]];
+            const auto& v1 = vertices[triangle.vertices[(k + 1) % 3]];
+            if (v0[axis] <= position) left.grow(v0);
+            if (v0[axis] >= position) right.grow(v0);
+            if ((v0[axis] < position && v1[axis] > position) || (v0[axis] > position && v1[axis] < position)){
+                float t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+                auto p = add_vecs(v0, scale_vec(t, subtract_vecs(v1, v0)));
+                p[axis] = position;
+                left.grow(p);
+                right.grow(p);
+            }
+        }
+        // earlier splits may already have cut the triangle down to box
+        left = left.clip(box);
+        right = right.clip(box);
+    };
 
-    float min_t = INFINITY;
-    bool hit = false;
-    glm::vec3 n(0,0,0), p(0,0,0);
-
-    // ref: https://github.com/0ctobyte/raytracer/blob/master/src/mesh.cpp
-    for(auto& triangle: triangles){
-
-        // Compute the intersection using Moller & Trumbore's algorithm and Cramer's rule
-        // The following variables are the expanded terms from the matrix form of the system
-        auto A = vertices[triangle.vertices[0]];
-        auto B = vertices[triangle.vertices[1]];
-        auto C = vertices[triangle.vertices[2]];
-
-        auto e1 = subtract_vecs(B,A);
-        auto e2 = subtract_vecs(C,A);
-        auto h = cross_product(ray.d,e2);
-
-        // If determinant is zero then the ray is parallel to the triangle
-        auto det = dot_product(h,e1);
-        if (det < EPS) continue;
-
-        // Calculate alpha, barycentric coordinate, and make sure it is within range of [0, 1]
-        auto s = subtract_vecs(ray.o, A);
-        float alpha = dot_product(s,h) / det;
-        if (alpha < 0.0 || alpha > 1.0) continue;
-
-        // Calculate v, barycentric coordinate, and make sure it is within range. 
-        // alpha + beta must be less than 1!
-        auto q = cross_product(s,e1);
-        auto beta = dot_product(ray.d,q) / det;
-        if (beta < 0.0 || (alpha + beta) > 1.0) continue;
-
-        auto t = dot_product(e2, q) / det;
-        if(t > EPS && t < min_t){  // The ray intersects this triangle
-            hit = true;
-            min_t = t;
-            p = ray.at(min_t);
-            auto gamma = 1.0 - (alpha + beta);
-            if (use_precomputed){
-                auto v1 = scale_vec(gamma, pnormals[triangle.vertices[0]]);
-                auto v2 = scale_vec(alpha, pnormals[triangle.vertices[1]]);
-                auto v3 = scale_vec(beta, pnormals[triangle.vertices[2]]);
-                auto tmp = add_vecs(v1,v2);
-                n = normalize(add_vecs(tmp,v3));
+    bvh.build(getTriangleBounds(), builder, split_triangle);
+    if (with_blocks) buildBlocks();
+}
+
+void Model::buildBlocks()
+{
+    const int width = TriangleBlock::width;
+    blocks.assign((bvh.indices.size() + width - 1) / width, TriangleBlock());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks.size(), 1024), [&](const tbb::blocked_range<size_t>& range){
+        for (size_t b = range.begin(); b != range.end(); b++){
+            // lanes past the last triangle stay zero, degenerate triangles never hit
+            for (size_t i = b * width; i < std::min(bvh.indices.size(), (b + 1) * width); i++){
+                const auto& triangle = triangles[bvh.indices[i]];
+                for (int k = 0; k < 3; k++){
+                    for (int axis = 0; axis < 3; axis++){
+                        blocks[b].v[k][axis][i % width] = vertices[triangle.vertices[k]][axis];
+                    }
+                }
             }
-            else{
-                auto v1 = scale_vec(gamma, normals[triangle.vertices[0]]);
-                auto v2 = scale_vec(alpha, normals[triangle.vertices[1]]);
-                auto v3 = scale_vec(beta, normals[triangle.vertices[2]]);
-                auto tmp = add_vecs(v1,v2);
-                n = normalize(add_vecs(tmp,v3));
+        }
+    });
+}
+
+AABB Model::getBounds() const
+{
+    if (isCompressed()) return compressed.mesh_bounds;
+    if (!bvh.empty()) return bvh.nodes[0].box;
+
+    AABB box;
+    for (const auto& vertex: vertices) box.grow(vertex);
+    return box;
+}
+
+static inline bool intersect_compressed(const ShearedRay& ray, const CompressedBVH& compressed,
+    const CompressedBVH::CompressedTriangle& triangle, float t_max, float& t, float& alpha, float& beta)
+{
+    return intersectTriangle(ray, compressed.vertex(triangle, 0), compressed.vertex(triangle, 1),
+        compressed.vertex(triangle, 2), t_max, t, alpha, beta);
+}
+
+// calls hit(slot, t, alpha, beta) with the nearest hit in every block
+// overlapping the slots [first, first + count) of the hierarchy indices
+template<typename Hit>
+static inline void intersect_slots(const ShearedRay& ray, const std::vector<TriangleBlock>& blocks,
+    unsigned first, unsigned count, float t_max, Hit&& hit)
+{
+    const unsigned width = TriangleBlock::width;
+    float t, alpha, beta;
+    for (unsigned b = first / width; b * width < first + count; b++){
+        unsigned begin = std::max(first, b * width) - b * width;
+        unsigned end = std::min(first + count, (b + 1) * width) - b * width;
+        unsigned mask = ((1u << end) - 1) & ~((1u << begin) - 1);
+        int lane = intersectBlock(blocks[b], mask, ray, t_max, t, alpha, beta);
+        if (lane < 0) continue;
+        if (hit(b * width + lane, t, alpha, beta)) return;
+        t_max = t;
+    }
+}
+
+bool Model::intersect(const Ray& ray, float t_max, Intersection& isect) const
+{
+    bool hit = false;
+    auto record = [&](unsigned prim, float t, float alpha, float beta, float& t_max){
+        hit = true;
+        t_max = t;
+        isect.t = t;
+        isect.u = alpha;
+        isect.v = beta;
+        isect.prim = prim;
+        isect.obj = this;
+    };
+
+    ShearedRay sheared(ray);
+    if (isCompressed()){
+        float t, alpha, beta;
+        compressed.traverse(ray, t_max, [&](const CompressedBVH::CompressedTriangle& triangle, float& t_max){
+            if (intersect_compressed(sheared, compressed, triangle, t_max, t, alpha, beta)) record(triangle.prim, t, alpha, beta, t_max);
+        });
+        return hit;
+    }
+
+    bvh.traverseLeaves(ray, t_max, [&](unsigned first, unsigned count, float& t_max){
+        intersect_slots(sheared, blocks, first, count, t_max, [&](unsigned slot, float t, float alpha, float beta){
+            record(bvh.indices[slot], t, alpha, beta, t_max);
+            return false;
+        });
+    });
+
+    return hit;
+}
+
+HitRecord Model::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    // the normal is interpolated once, for the closest triangle only
+    const auto& triangle = triangles[isect.prim];
+    const auto& vertex_normals = use_precomputed ? pnormals : normals;
+    auto gamma = 1.0 - (isect.u + isect.v);
+
+    auto v1 = scale_vec(gamma, vertex_normals[triangle.vertices[0]]);
+    auto v2 = scale_vec(isect.u, vertex_normals[triangle.vertices[1]]);
+    auto v3 = scale_vec(isect.v, vertex_normals[triangle.vertices[2]]);
+    auto tmp = add_vecs(v1,v2);
+    auto n = normalize(add_vecs(tmp,v3));
+
+    return HitRecord(true, isect.t, ray.at(isect.t), n, *this, ray);
+}
+
+bool Model::occluded(const Ray& ray, float t_max) const
+{
+    ShearedRay sheared(ray);
+    if (isCompressed()){
+        float t, alpha, beta;
+        return compressed.occluded(ray, t_max, [&](const CompressedBVH::CompressedTriangle& triangle){
+            return intersect_compressed(sheared, compressed, triangle, t_max, t, alpha, beta);
+        });
+    }
+
+    return bvh.occludedLeaves(ray, t_max, [&](unsigned first, unsigned count){
+        bool blocked = false;
+        intersect_slots(sheared, blocks, first, count, t_max, [&](unsigned, float, float, float){
+            blocked = true;
+            return true;
+        });
+        return blocked;
+    });
+}
+
+RayMask Model::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    // the compressed layout is walked ray by ray
+    if (isCompressed()) return Primitive::intersectPacket(packet, active, t_max, isects);
+
+    ShearedRay sheared[RayPacket::max_size];
+    float t_ray[RayPacket::max_size];
+    for (RayMask rays = active; rays; rays &= rays - 1){
+        int k = __builtin_ctzll(rays);
+        sheared[k] = ShearedRay(packet.ray(k));
+        t_ray[k] = t_max[k];
+    }
+
+    RayMask hits = 0;
+    bvh.traversePacket(packet, active, t_ray, [&](unsigned first, unsigned count, RayMask rays, float* t_max){
+        for (; rays; rays &= rays - 1){
+            int k = __builtin_ctzll(rays);
+            intersect_slots(sheared[k], blocks, first, count, t_max[k], [&](unsigned slot, float t, float alpha, float beta){
+                t_max[k] = t;
+                isects[k].t = t;
+                isects[k].u = alpha;
+                isects[k].v = beta;
+                isects[k].prim = bvh.indices[slot];
+                isects[k].obj = this;
+                hits |= RayMask(1) << k;
+                return false;
+            });
+        }
+    });
+
+    return hits;
+}
+
+RayMask Model::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    if (isCompressed()) return Primitive::occludedPacket(packet, active, t_max);
+
+    ShearedRay sheared[RayPacket::max_size];
+    for (RayMask rays = active; rays; rays &= rays - 1){
+        int k = __builtin_ctzll(rays);
+        sheared[k] = ShearedRay(packet.ray(k));
+    }
+
+    return bvh.occludedPacket(packet, active, t_max, [&](unsigned first, unsigned count, RayMask rays){
+        RayMask blocked = 0;
+        for (; rays; rays &= rays - 1){
+            int k = __builtin_ctzll(rays);
+            intersect_slots(sheared[k], blocks, first, count, t_max[k], [&](unsigned, float, float, float){
+                blocked |= RayMask(1) << k;
+                return true;
+            });
+        }
+        return blocked;
+    });
+}
+
+bool Model::compress()
+{
+    if (!compressed.build(bvh, triangles, vertices)){
+        compressed = CompressedBVH();
+        return false;
+    }
+
+    // the triangles stay for the normal lookups of getHitRecord
+    bvh = BVH();
+    std::vector<glm::vec3>().swap(vertices);
+    std::vector<TriangleBlock>().swap(blocks);
+    return true;
+}
+
+size_t Model::memoryUsage() const
+{
+    size_t bytes = triangles.size() * sizeof(Triangle);
+    if (isCompressed()) return bytes + compressed.memoryUsage();
+
+    return bytes + vertices.size() * sizeof(glm::vec3) + blocks.size() * sizeof(TriangleBlock) + bvh.nodes.size() * sizeof(BVH::Node)
+        + bvh.wide_nodes.size() * sizeof(BVH::WideNode) + bvh.indices.size() * sizeof(unsigned);
+}
+
+// ---------------------------------------------------------------------------------------------------
+SphereCloud::SphereCloud(float spec_coef, const ofFloatColor& color):
+    num_spheres(0){
+        this->color = color;
+        this->specular_coeff = spec_coef;
+        reflect = false;
+    }
+
+void SphereCloud::add(const glm::vec3& center, float radius)
+{
+    add(center, radius, color);
+}
+
+void SphereCloud::add(const glm::vec3& center, float radius, const ofFloatColor& color)
+{
+    // the built groups and hierarchy would not see it
+    if (isBuilt()){
+        ofLogWarning("SphereCloud::add") << "the cloud is already built, ignoring the sphere";
+        return;
+    }
+    staged_centers.push_back(center);
+    staged_radii.push_back(radius);
+    staged_colors.push_back(color);
+    num_spheres++;
+}
+
+void SphereCloud::build(BVHBuilder builder)
+{
+    const unsigned width = SphereLanes::width;
+    if (staged_centers.empty()) return;
+
+    // spheres close along the curve are close in space, so a group of 8 of
+    // them makes a tight box
+    const auto& centers = staged_centers;
+    std::vector<unsigned> order;
+    std::vector<uint64_t> codes;
+    BVH::mortonSort(centers, order, codes);
+
+    // the last group repeats its first sphere, which the kernel then finds
+    // at the same distance as the sphere itself
+    unsigned num_groups = (num_spheres + width - 1) / width;
+    auto sphere = [&](unsigned slot){ return order[slot < num_spheres ? slot : slot / width * width]; };
+
+    std::vector<AABB> group_bounds(num_groups);
+    tbb::parallel_for(tbb::blocked_range<unsigned>(0, num_groups, 1024), [&](const tbb::blocked_range<unsigned>& range){
+        for (unsigned g = range.begin(); g != range.end(); g++){
+            for (unsigned slot = g * width; slot < (g + 1) * width; slot++){
+                unsigned i = sphere(slot);
+                float r = staged_radii[i];
+                group_bounds[g].grow(subtract_vecs(centers[i], glm::vec3(r, r, r)));
+                group_bounds[g].grow(add_vecs(centers[i], glm::vec3(r, r, r)));
             }
         }
+    });
+    bvh.build(group_bounds, builder);
+
+    // the groups once more in the order of the leaves, the spatial builder
+    // may reference a group from several of them
+    colors.reserve(bvh.indices.size() * width);
+    for (auto g: bvh.indices){
+        for (unsigned slot = g * width; slot < (g + 1) * width; slot++){
+            unsigned i = sphere(slot);
+            lanes.set(lanes.size(), centers[i], staged_radii[i]);
+            colors.push_back(staged_colors[i]);
+        }
+    }
+
+    staged_centers = std::vector<glm::vec3>();
+    staged_radii = std::vector<float>();
+    staged_colors = std::vector<ofFloatColor>();
+}
+
+AABB SphereCloud::getBounds() const
+{
+    if (!bvh.empty()) return bvh.nodes[0].box;
+
+    AABB box;
+    for (size_t i = 0; i < staged_centers.size(); i++){
+        float r = staged_radii[i];
+        box.grow(subtract_vecs(staged_centers[i], glm::vec3(r, r, r)));
+        box.grow(add_vecs(staged_centers[i], glm::vec3(r, r, r)));
+    }
+    return box;
+}
+
+int SphereCloud::intersectGroups(const Ray& ray, unsigned first, unsigned count, float t_max, float& t) const
+{
+    const unsigned width = SphereLanes::width;
+    return intersectSpheres(lanes, first * width, count * width, ray, t_max, t);
+}
+
+bool SphereCloud::intersect(const Ray& ray, float t_max, Intersection& isect) const
+{
+    bool hit = false;
+    bvh.traverseLeaves(ray, t_max, [&](unsigned first, unsigned count, float& t_max){
+        float t;
+        int lane = intersectGroups(ray, first, count, t_max, t);
+        if (lane < 0) return;
+        hit = true;
+        isect.t = t_max = t;
+        isect.prim = first * SphereLanes::width + lane;
+        isect.obj = this;
+    });
+    return hit;
+}
+
+HitRecord SphereCloud::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    auto p = ray.at(isect.t);
+    auto n = scale_vec(1.f / lanes.radius[isect.prim], subtract_vecs(p, lanes.getCenter(isect.prim)));
+
+    HitRecord record(true, isect.t, p, n, *this, ray);
+    record.prim = isect.prim;
+    return record;
+}
+
+bool SphereCloud::occluded(const Ray& ray, float t_max) const
+{
+    return bvh.occludedLeaves(ray, t_max, [&](unsigned first, unsigned count){
+        float t;
+        return intersectGroups(ray, first, count, t_max, t) >= 0;
+    });
+}
+
+RayMask SphereCloud::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    float t_ray[RayPacket::max_size];
+    for (RayMask rays = active; rays; rays &= rays - 1){
+        int k = __builtin_ctzll(rays);
+        t_ray[k] = t_max[k];
+    }
+
+    RayMask hits = 0;
+    bvh.traversePacket(packet, active, t_ray, [&](unsigned first, unsigned count, RayMask rays, float* t_max){
+        for (; rays; rays &= rays - 1){
+            int k = __builtin_ctzll(rays);
+            float t;
+            int lane = intersectGroups(packet.ray(k), first, count, t_max[k], t);
+            if (lane < 0) continue;
+            isects[k].t = t_max[k] = t;
+            isects[k].prim = first * SphereLanes::width + lane;
+            isects[k].obj = this;
+            hits |= RayMask(1) << k;
+        }
+    });
+
+    return hits;
+}
+
+RayMask SphereCloud::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    return bvh.occludedPacket(packet, active, t_max, [&](unsigned first, unsigned count, RayMask rays){
+        RayMask blocked = 0;
+        for (; rays; rays &= rays - 1){
+            int k = __builtin_ctzll(rays);
+            float t;
+            if (intersectGroups(packet.ray(k), first, count, t_max[k], t) >= 0) blocked |= RayMask(1) << k;
+        }
+        return blocked;
+    });
+}
+
+size_t SphereCloud::memoryUsage() const
+{
+    size_t staged = staged_centers.size() * (sizeof(glm::vec3) + sizeof(float) + sizeof(ofFloatColor));
+    return staged + lanes.size() * 4 * sizeof(float) + colors.size() * sizeof(ofFloatColor) + bvh.nodes.size() * sizeof(BVH::Node)
+        + bvh.wide_nodes.size() * sizeof(BVH::WideNode) + bvh.indices.size() * sizeof(unsigned);
+}
+
+// ---------------------------------------------------------------------------------------------------
+Instance::Instance(std::shared_ptr<const Primitive> obj, const Transform& m):
+    object(obj), object_bounds(obj->getBounds()), to_world(m), to_object(m.inverse()), to_world_default(m){
+        this->color = object->getColor();
+        this->specular_coeff = object->getSpecularCoeff();
+        this->reflect = object->isReflectEnabled();
     }
 
-    return HitRecord(hit, min_t, p, n, *this, ray);
+bool Instance::intersect(const Ray& ray, float t_max, Intersection& isect) const
+{
+    if (!object->intersect(toObject(ray), t_max, isect)) return false;
+    isect.obj = this;
+    return true;
+}
+
+HitRecord Instance::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    auto record = object->getHitRecord(toObject(ray), isect);
+    auto n = normalize(to_object.normal(record.n));
+
+    HitRecord world(true, isect.t, ray.at(isect.t), n, *this, ray);
+    world.prim = record.prim;
+    return world;
+}
+
+bool Instance::occluded(const Ray& ray, float t_max) const
+{
+    return object->occluded(toObject(ray), t_max);
+}
+
+RayMask Instance::intersectPacket(const RayPacket& packet, RayMask active, const float* t_max, Intersection* isects) const
+{
+    RayMask hits = object->intersectPacket(toObject(packet), active, t_max, isects);
+    for (RayMask rays = hits; rays; rays &= rays - 1){
+        isects[__builtin_ctzll(rays)].obj = this;
+    }
+    return hits;
+}
+
+RayMask Instance::occludedPacket(const RayPacket& packet, RayMask active, const float* t_max) const
+{
+    return object->occludedPacket(toObject(packet), active, t_max);
+}
+
+RayPacket Instance::toObject(const RayPacket& packet) const
+{
+    RayPacket local;
+    local.size = packet.size;
+    for (int k = 0; k < packet.size; k++){
+        auto ray = toObject(packet.ray(k));
+        for (int axis = 0; axis < 3; axis++){
+            local.o[axis][k] = ray.o[axis];
+            local.d[axis][k] = ray.d[axis];
+        }
+    }
+    return local;
+}
+
+void Instance::transformAroundOrigin(const glm::mat4& m)
+{
+    auto origin = to_world.point(glm::vec3(0,0,0));
+    to_world = Transform(translation(origin[0], origin[1], origin[2])) * Transform(m)
+        * Transform(translation(-origin[0], -origin[1], -origin[2])) * to_world;
+    to_object = to_world.inverse();
+}
+
+void Instance::rotate(const glm::mat4& m)
+{
+    transformAroundOrigin(m);
+}
+
+void Instance::translate(const glm::mat4& m)
+{
+    to_world = Transform(m) * to_world;
+    to_object = to_world.inverse();
+}
+
+void Instance::scale(const glm::mat4& m)
+{
+    transformAroundOrigin(m);
+}
+
+void Instance::reset()
+{
+    to_world = to_world_default;
+    to_object = to_world.inverse();
 }
 
 // ---------------------------------------------------------------------------------------------------
@@ -383,33 +1019,26 @@ BBox::BBox(const glm::vec3& v1, const glm::vec3& v2):
     this->color = ofFloatColor(1,1,1,1);
 }
 
-HitRecord BBox::hit(const Ray& ray) const
+bool BBox::intersect(const Ray& ray, float t_max, Intersection& isect) const
 {
-    // ref: http://web.cse.ohio-state.edu/~parent.1/classes/782/Lectures/02_Intersections.pdf
-    glm::vec3 n,p;
     auto inv_dir = glm::vec3(1.f/ray.d[0], 1.f/ray.d[1], 1.f/ray.d[2]);
-    auto delta_min = hadamard_product(inv_dir, subtract_vecs(min, ray.o));
-    auto delta_max = hadamard_product(inv_dir, subtract_vecs(max, ray.o));
-
-    float tmin = delta_min.x;
-    float tmax = delta_max.x;
-    if(tmin > tmax) std::swap(tmin, tmax);
-    
-    float tmin_y = delta_min.y;
-    float tmax_y = delta_max.y;
-    if(tmin_y > tmax_y) std::swap(tmin_y, tmax_y);
+    float t_near;
+    if (!AABB(min, max).intersect(ray, inv_dir, t_max, t_near)) return false;
 
-    tmin = std::min(tmin, tmin_y);
-    tmax = std::max(tmax, tmax_y);
-    
-    float tmin_z = delta_min.z;
-    float tmax_z = delta_max.z;
-    if(tmin_z > tmax_z) std::swap(tmin_z, tmax_z);
-
-    if(tmin > tmax_z || tmin_z > tmax) return HitRecord();
+    isect.t = t_near;
+    isect.obj = this;
+    return true;
+}
 
-    tmin = std::min(tmin, tmin_z);
-    tmax = std::max(tmax, tmax_z);
+HitRecord BBox::getHitRecord(const Ray& ray, const Intersection& isect) const
+{
+    glm::vec3 n(0,0,0);
+    return HitRecord(true, isect.t, ray.at(isect.t), n, *this, ray);
+}
 
-    return HitRecord(true, tmin, p, n, *this, ray);
-}
\ No newline at end of file
+bool BBox::occluded(const Ray& ray, float t_max) const
+{
+    auto inv_dir = glm::vec3(1.f/ray.d[0], 1.f/ray.d[1], 1.f/ray.d[2]);
+    float t_near;
+    return AABB(min, max).intersect(ray, inv_dir, t_max, t_near);
+}
@@ -0,0 +1,252 @@
+#include "rtQuadrics.h"
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#endif
+
+void SphereLanes::clear()
+{
+    for (int k = 0; k < 3; k++) center[k].clear();
+    radius.clear();
+    count = 0;
+}
+
+void SphereLanes::set(size_t i, const glm::vec3& c, float r)
+{
+    if (i == count){
+        count++;
+        for (int k = 0; k < 3; k++) center[k].resize(count + width - 1);
+        radius.resize(count + width - 1);
+    }
+    for (int k = 0; k < 3; k++) center[k][i] = c[k];
+    radius[i] = r;
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+// 8 floats in one AVX register, in two SSE ones or in a plain array, and the
+// masks their comparisons give. Only the operations the kernels need, each
+// rounding as its scalar counterpart does.
+#if defined(__AVX__)
+struct Float8 { __m256 v; };
+struct Mask8 { __m256 v; };
+
+static inline Float8 set1(float x) { return {_mm256_set1_ps(x)}; }
+static inline Float8 load(const float* p) { return {_mm256_loadu_ps(p)}; }
+static inline void store(float* p, Float8 a) { _mm256_storeu_ps(p, a.v); }
+static inline Float8 operator+(Float8 a, Float8 b) { return {_mm256_add_ps(a.v, b.v)}; }
+static inline Float8 operator-(Float8 a, Float8 b) { return {_mm256_sub_ps(a.v, b.v)}; }
+static inline Float8 operator*(Float8 a, Float8 b) { return {_mm256_mul_ps(a.v, b.v)}; }
+static inline Float8 operator/(Float8 a, Float8 b) { return {_mm256_div_ps(a.v, b.v)}; }
+static inline Float8 operator-(Float8 a) { return {_mm256_xor_ps(a.v, _mm256_set1_ps(-0.f))}; }
+static inline Float8 square_root(Float8 a) { return {_mm256_sqrt_ps(a.v)}; }
+// std::min(a, b) and std::max(a, b), operands swapped to pick the same one on ties
+static inline Float8 minimum(Float8 a, Float8 b) { return {_mm256_min_ps(b.v, a.v)}; }
+static inline Float8 maximum(Float8 a, Float8 b) { return {_mm256_max_ps(b.v, a.v)}; }
+static inline Mask8 operator<(Float8 a, Float8 b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+static inline Mask8 operator<=(Float8 a, Float8 b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+static inline Mask8 operator>=(Float8 a, Float8 b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+static inline unsigned bits(Mask8 m) { return _mm256_movemask_ps(m.v); }
+// m ? a : b
+static inline Float8 select(Mask8 m, Float8 a, Float8 b) { return {_mm256_blendv_ps(b.v, a.v, m.v)}; }
+#elif defined(__SSE__) || defined(_M_X64)
+struct Float8 { __m128 lo, hi; };
+struct Mask8 { __m128 lo, hi; };
+
+static inline Float8 set1(float x) { return {_mm_set1_ps(x), _mm_set1_ps(x)}; }
+static inline Float8 load(const float* p) { return {_mm_loadu_ps(p), _mm_loadu_ps(p + 4)}; }
+static inline void store(float* p, Float8 a) { _mm_storeu_ps(p, a.lo); _mm_storeu_ps(p + 4, a.hi); }
+static inline Float8 operator+(Float8 a, Float8 b) { return {_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)}; }
+static inline Float8 operator-(Float8 a, Float8 b) { return {_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)}; }
+static inline Float8 operator*(Float8 a, Float8 b) { return {_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)}; }
+static inline Float8 operator/(Float8 a, Float8 b) { return {_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)}; }
+static inline Float8 operator-(Float8 a) {
+    __m128 sign = _mm_set1_ps(-0.f);
+    return {_mm_xor_ps(a.lo, sign), _mm_xor_ps(a.hi, sign)};
+}
+static inline Float8 square_root(Float8 a) { return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)}; }
+static inline Float8 minimum(Float8 a, Float8 b) { return {_mm_min_ps(b.lo, a.lo), _mm_min_ps(b.hi, a.hi)}; }
+static inline Float8 maximum(Float8 a, Float8 b) { return {_mm_max_ps(b.lo, a.lo), _mm_max_ps(b.hi, a.hi)}; }
+static inline Mask8 operator<(Float8 a, Float8 b) { return {_mm_cmplt_ps(a.lo, b.lo), _mm_cmplt_ps(a.hi, b.hi)}; }
+static inline Mask8 operator<=(Float8 a, Float8 b) { return {_mm_cmple_ps(a.lo, b.lo), _mm_cmple_ps(a.hi, b.hi)}; }
+static inline Mask8 operator>=(Float8 a, Float8 b) { return {_mm_cmpge_ps(a.lo, b.lo), _mm_cmpge_ps(a.hi, b.hi)}; }
+static inline unsigned bits(Mask8 m) { return _mm_movemask_ps(m.lo) | _mm_movemask_ps(m.hi) << 4; }
+static inline Float8 select(Mask8 m, Float8 a, Float8 b) {
+    return {_mm_or_ps(_mm_and_ps(m.lo, a.lo), _mm_andnot_ps(m.lo, b.lo)),
+        _mm_or_ps(_mm_and_ps(m.hi, a.hi), _mm_andnot_ps(m.hi, b.hi))};
+}
+#else
+struct Float8 { float v[8]; };
+struct Mask8 { bool v[8]; };
+
+template<typename Op>
+static inline Float8 each_lane(Op&& op) { Float8 r; for (int i = 0; i < 8; i++) r.v[i] = op(i); return r; }
+template<typename Op>
+static inline Mask8 each_mask(Op&& op) { Mask8 r; for (int i = 0; i < 8; i++) r.v[i] = op(i); return r; }
+
+static inline Float8 set1(float x) { return each_lane([&](int){ return x; }); }
+static inline Float8 load(const float* p) { return each_lane([&](int i){ return p[i]; }); }
+static inline void store(float* p, Float8 a) { for (int i = 0; i < 8; i++) p[i] = a.v[i]; }
+static inline Float8 operator+(Float8 a, Float8 b) { return each_lane([&](int i){ return a.v[i] + b.v[i]; }); }
+static inline Float8 operator-(Float8 a, Float8 b) { return each_lane([&](int i){ return a.v[i] - b.v[i]; }); }
+static inline Float8 operator*(Float8 a, Float8 b) { return each_lane([&](int i){ return a.v[i] * b.v[i]; }); }
+static inline Float8 operator/(Float8 a, Float8 b) { return each_lane([&](int i){ return a.v[i] / b.v[i]; }); }
+static inline Float8 operator-(Float8 a) { return each_lane([&](int i){ return -a.v[i]; }); }
+static inline Float8 square_root(Float8 a) { return each_lane([&](int i){ return std::sqrt(a.v[i]); }); }
+static inline Float8 minimum(Float8 a, Float8 b) { return each_lane([&](int i){ return std::min(a.v[i], b.v[i]); }); }
+static inline Float8 maximum(Float8 a, Float8 b) { return each_lane([&](int i){ return std::max(a.v[i], b.v[i]); }); }
+static inline Mask8 operator<(Float8 a, Float8 b) { return each_mask([&](int i){ return a.v[i] < b.v[i]; }); }
+static inline Mask8 operator<=(Float8 a, Float8 b) { return each_mask([&](int i){ return a.v[i] <= b.v[i]; }); }
+static inline Mask8 operator>=(Float8 a, Float8 b) { return each_mask([&](int i){ return a.v[i] >= b.v[i]; }); }
+static inline unsigned bits(Mask8 m) { unsigned r = 0; for (int i = 0; i < 8; i++) r |= unsigned(m.v[i]) << i; return r; }
+static inline Float8 select(Mask8 m, Float8 a, Float8 b) { return each_lane([&](int i){ return m.v[i] ? a.v[i] : b.v[i]; }); }
+#endif
+
+// the smallest float not below EPS, the float compares against it agree
+// with the double ones of the scalar code
+static const float eps = static_cast<float>(EPS) < EPS ?
+    std::nextafter(static_cast<float>(EPS), INFINITY) : static_cast<float>(EPS);
+
+// solve_quadratic followed by min_distance, for the lanes whose discriminant
+// b^2 - 4ac is not negative
+static inline Float8 nearer_root(Float8 a, Float8 b, Float8 discriminant)
+{
+    Float8 root = square_root(discriminant);
+    Float8 t1 = (-b + root) / (set1(2.f) * a);
+    Float8 t2 = (-b - root) / (set1(2.f) * a);
+
+    Float8 min_t = minimum(t1, t2), max_t = maximum(t1, t2);
+    return select(min_t < set1(eps), max_t, min_t);
+}
+
+// Runs chunk(i, t_max, t) over the count lanes 8 at a time, i the first lane
+// of each step. It stores the distances of its 8 lanes in t and returns the
+// bits of those hit before t_max. The nearest hit wins, the first lane on ties.
+template<typename Chunk>
+static inline int nearest_hit(unsigned count, float t_max, float& t, Chunk&& chunk)
+{
+    const int width = SphereLanes::width;
+    alignas(32) float t_lane[width];
+    int nearest = -1;
+    for (unsigned k = 0; k < count; k += width){
+        unsigned mask = chunk(k, t_max, t_lane);
+        if (count - k < width) mask &= (1u << (count - k)) - 1;
+        for (; mask; mask &= mask - 1){
+            int lane = __builtin_ctz(mask);
+            if (t_lane[lane] < t_max){
+                t_max = t_lane[lane];
+                nearest = static_cast<int>(k) + lane;
+            }
+        }
+    }
+    if (nearest >= 0) t = t_max;
+    return nearest;
+}
+
+int intersectSpheres(const SphereLanes& lanes, unsigned first, unsigned count, const Ray& ray, float t_max, float& t)
+{
+    Float8 ox = set1(ray.o[0]), oy = set1(ray.o[1]), oz = set1(ray.o[2]);
+    Float8 dx = set1(ray.d[0]), dy = set1(ray.d[1]), dz = set1(ray.d[2]);
+    Float8 a = set1(dot_product(ray.d, ray.d));
+
+    return nearest_hit(count, t_max, t, [&](unsigned k, float t_max, float* t_lane){
+        size_t i = first + k;
+        Float8 x = ox - load(&lanes.center[0][i]), y = oy - load(&lanes.center[1][i]), z = oz - load(&lanes.center[2][i]);
+        Float8 radius = load(&lanes.radius[i]);
+        Float8 b = set1(2.f) * (x * dx + y * dy + z * dz);
+        Float8 c = (x * x + y * y + z * z) - radius * radius;
+
+        // most rays miss most of the quadrics, which the discriminant tells
+        Float8 discriminant = b * b - set1(4.f) * a * c;
+        unsigned valid = bits(discriminant >= set1(0.f));
+        if (!valid) return 0u;
+
+        Float8 t_hit = nearer_root(a, b, discriminant);
+        store(t_lane, t_hit);
+        return valid & bits(t_hit >= set1(eps)) & bits(t_hit < set1(t_max));
+    });
+}
+
+// a vector of 8 lanes, one component per register
+struct Vec8 { Float8 x, y, z; };
+
+static inline Vec8 set1(const glm::vec3& v) { return {set1(v[0]), set1(v[1]), set1(v[2])}; }
+static inline Vec8 load(const float (*v)[RayPacket::max_size], int i) { return {load(&v[0][i]), load(&v[1][i]), load(&v[2][i])}; }
+static inline Vec8 operator-(Vec8 a, Vec8 b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+static inline Float8 dot(Vec8 a, Vec8 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+// ray.at(t) - p
+static inline Vec8 from(Vec8 o, Vec8 d, Float8 t, Vec8 p) { return {o.x + t * d.x - p.x, o.y + t * d.y - p.y, o.z + t * d.z - p.z}; }
+
+// The lanes whose ray hits the cone within its height, as bits, and the
+// distance of the hit in t. Only those bits say anything about t.
+static inline unsigned hitCone(Vec8 o, Vec8 d, Vec8 apex, Vec8 axis, Float8 cosa, Float8 height, Float8& t)
+{
+    Vec8 co = o - apex;
+    Float8 dv = dot(d, axis);
+    Float8 cv = dot(co, axis);
+    Float8 a = dv * dv - cosa * cosa;
+    Float8 b = set1(2.f) * (dv * cv - dot(d, co) * cosa * cosa);
+    Float8 c = cv * cv - dot(co, co) * cosa * cosa;
+
+    Float8 discriminant = b * b - set1(4.f) * a * c;
+    unsigned valid = bits(discriminant >= set1(0.f));
+    if (!valid) return 0u;
+
+    t = nearer_root(a, b, discriminant);
+
+    // height of the hit along the axis, within the cone
+    Float8 h = dot(from(o, d, t, apex), axis);
+    return valid & bits(h >= set1(eps)) & bits(h <= height);
+}
+
+// the same for a cylinder, its origin the center of its bottom
+static inline unsigned hitCylinder(Vec8 o, Vec8 d, Vec8 bottom, Vec8 axis, Float8 radius, Float8 height, Float8& t)
+{
+    Vec8 co = o - bottom;
+    Float8 da = dot(d, axis);
+    Float8 ba = dot(co, axis);
+    Float8 a = dot(d, d) - da * da;
+    Float8 b = set1(2.f) * (dot(d, co) - da * ba);
+    Float8 c = dot(co, co) - ba * ba - radius * radius;
+
+    Float8 discriminant = b * b - set1(4.f) * a * c;
+    unsigned valid = bits(discriminant >= set1(0.f));
+    if (!valid) return 0u;
+
+    t = nearer_root(a, b, discriminant);
+
+    Float8 h = dot(from(o, d, t, bottom), axis);
+    return valid & bits(h >= set1(eps)) & bits(h <= height);
+}
+
+// Runs hit(o, d, t_hit) over the rays of the packet 8 at a time and stores
+// their distances in t, -INFINITY for the lanes it leaves out
+template<typename Hit>
+static inline void packet_hits(const RayPacket& packet, float* t, Hit&& hit)
+{
+    const int width = SphereLanes::width;
+    for (int k = 0; k < packet.size; k += width){
+        Float8 t_hit;
+        unsigned mask = hit(load(packet.o, k), load(packet.d, k), t_hit);
+        if (mask) store(t + k, t_hit);
+        for (int lane = 0; lane < width; lane++)
+            if (!(mask >> lane & 1u)) t[k + lane] = -INFINITY;
+    }
+}
+
+void intersectConePacket(const RayPacket& packet, const glm::vec3& apex, const glm::vec3& axis, float cosa, float height, float* t)
+{
+    Vec8 p = set1(apex), a = set1(axis);
+    Float8 c = set1(cosa), h = set1(height);
+    packet_hits(packet, t, [&](Vec8 o, Vec8 d, Float8& t_hit){ return hitCone(o, d, p, a, c, h, t_hit); });
+}
+
+void intersectCylinderPacket(const RayPacket& packet, const glm::vec3& bottom, const glm::vec3& axis, float radius, float height, float* t)
+{
+    Vec8 p = set1(bottom), a = set1(axis);
+    Float8 r = set1(radius), h = set1(height);
+    packet_hits(packet, t, [&](Vec8 o, Vec8 d, Float8& t_hit){ return hitCylinder(o, d, p, a, r, h, t_hit); });
+}
@@ -0,0 +1,75 @@
+#include "rtRayStream.h"
+#include <algorithm>
+#include <cmath>
+
+void RayStream::clear()
+{
+    rays.clear();
+    ids.clear();
+}
+
+void RayStream::add(const Ray& ray, unsigned id)
+{
+    rays.push_back(ray);
+    ids.push_back(id);
+}
+
+// spreads the low 5 bits of v so that two zero bits follow each of them
+static uint32_t expand_bits(uint32_t v)
+{
+    v &= 0x1f;
+    v = (v | v << 8) & 0x100f;
+    v = (v | v << 4) & 0x10c3;
+    v = (v | v << 2) & 0x1249;
+    return v;
+}
+
+void RayStream::sort()
+{
+    AABB bounds;
+    for (const auto& ray: rays) bounds.grow(ray.o);
+
+    // the signs of the directions are random, so the key is computed without branches
+    const float cells = static_cast<float>(1 << origin_bits);
+    const float steps = static_cast<float>(1 << direction_bits);
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++){
+        float extent = bounds.max[axis] - bounds.min[axis];
+        scale[axis] = extent > 0.f ? cells / extent : 0.f;
+    }
+
+    order.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); i++){
+        const auto& ray = rays[i];
+        uint32_t octant = 0, origin = 0, direction = 0;
+        for (int axis = 0; axis < 3; axis++){
+            octant |= static_cast<uint32_t>(std::signbit(ray.d[axis])) << axis;
+
+            int cell = static_cast<int>((ray.o[axis] - bounds.min[axis]) * scale[axis]);
+            origin |= expand_bits(static_cast<uint32_t>(std::min(std::max(cell, 0), (1 << origin_bits) - 1))) << axis;
+        }
+        // within the octant, the direction is the point it crosses on the
+        // face |x| + |y| + |z| = 1, which the first two components pin down.
+        // Directions are normalized, never zero.
+        float inv_length = steps / (std::abs(ray.d[0]) + std::abs(ray.d[1]) + std::abs(ray.d[2]));
+        for (int axis = 0; axis < 2; axis++){
+            int step = static_cast<int>(std::abs(ray.d[axis]) * inv_length);
+            direction = direction << direction_bits | std::min(step, (1 << direction_bits) - 1);
+        }
+
+        uint64_t key = (octant << (2 * direction_bits) | direction) << (3 * origin_bits) | origin;
+        order[i] = key << 32 | i;
+    }
+
+    // a tile holds tens of thousands of rays, sorted by an LSD radix sort
+    // over the bytes of the keys
+    const int key_bits = 3 + 2 * direction_bits + 3 * origin_bits;
+    scratch.resize(rays.size());
+    for (int shift = 32; shift < 32 + key_bits; shift += 8){
+        size_t offsets[257] = {};
+        for (auto entry: order) offsets[((entry >> shift) & 0xff) + 1]++;
+        for (int b = 0; b < 256; b++) offsets[b + 1] += offsets[b];
+        for (auto entry: order) scratch[offsets[(entry >> shift) & 0xff]++] = entry;
+        order.swap(scratch);
+    }
+}
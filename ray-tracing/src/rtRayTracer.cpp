@@ -2,230 +2,767 @@
 
 RayTracer::RayTracer(int w, int h, Camera& c, const Viewport& v, 
     const AmbientLight& ambient):
-    width(w), height(h), camera(c),viewport(v), ambient_light(ambient) {
+    viewport(v), camera(c), height(h), width(w), frame(0), accumulated_samples(0), ambient_light(ambient),
+    rebuild_hierarchy(true), hierarchy_builder(BINNED_SAH), hierarchy_cost(0.f), hierarchy_build_time(0.f), wavefront_renderer(*this) {
 
 }
 
-float RayTracer::render(ofPixels& pixels,bool parallel)
+float RayTracer::render(ofPixels& pixels,bool parallel, const std::atomic<bool>* cancel)
+{
+    return renderFrame(pixels, parallel, cancel);
+}
+
+float RayTracer::render(ofFloatPixels& pixels,bool parallel, const std::atomic<bool>* cancel)
+{
+    return renderFrame(pixels, parallel, cancel);
+}
+
+static inline void store_color(unsigned char* p, const glm::vec4& color, size_t channels)
+{
+    for (size_t c = 0; c < channels; c++) p[c] = static_cast<unsigned char>(color[c] * 255.f);
+}
+
+static inline void store_color(float* p, const glm::vec4& color, size_t channels)
+{
+    for (size_t c = 0; c < channels; c++) p[c] = color[c];
+}
+
+template<typename PixelType>
+float RayTracer::renderFrame(ofPixels_<PixelType>& pixels, bool parallel, const std::atomic<bool>* cancel)
 {
     auto t_start = Clock::now();
-    if (parallel){
-        tbb::parallel_for(0, width, [&] (int i){
-            for(int j = 0; j < height; j++){
-                auto color = getPixelColor(i,j);
-                pixels.setColor(i, height-j-1, color);
-            }
-        });
-    }
-    else{
-        for(int i = 0; i < width; i++){
-            for(int j = 0; j < height; j++){
-                auto color = getPixelColor(i,j);
-                pixels.setColor(i, height-j-1, color);
-            }
+    updateSceneHierarchy();
+
+    int n_samples = std::max(1, settings.samples_per_pixel);
+    if (settings.wavefront){
+        // the samples of every pixel are added up in order, as in getPixelColor
+        wavefront_renderer.resetStats();
+        std::vector<glm::vec4> colors(width * height, glm::vec4(0,0,0,0)), sample_colors(width * height);
+        for (int s = 0; s < n_samples && !(cancel && *cancel); s++){
+            wavefront_renderer.renderSample(s, n_samples > 1, sample_colors.data(), parallel, cancel);
+            for (size_t k = 0; k < colors.size(); k++) colors[k] = add_vecs(colors[k], sample_colors[k]);
         }
+        for (auto& color: colors) color = scale_vec(1.f / n_samples, color);
+        storeImage(colors, pixels);
     }
+    else renderTiles(pixels, parallel, [&](int i, int j){
+        return getPixelColor(i, j);
+    }, [&](const Tile& block, glm::vec4* colors){
+        // the samples of a block are added up pixel by pixel, as in getPixelColor
+        thread_local std::vector<glm::vec4> sample_colors;
+        int n = (block.x1 - block.x0) * (block.y1 - block.y0);
+        sample_colors.resize(n);
+        std::fill_n(colors, n, glm::vec4(0,0,0,0));
+        for (int s = 0; s < n_samples; s++){
+            if (settings.ray_streams) getStreamColors(block, s, n_samples > 1, sample_colors.data());
+            else getBlockColors(block, s, n_samples > 1, sample_colors.data());
+            for (int k = 0; k < n; k++) colors[k] = add_vecs(colors[k], sample_colors[k]);
+        }
+        for (int k = 0; k < n; k++) colors[k] = scale_vec(1.f / n_samples, colors[k]);
+    }, cancel);
     
+    frame++;
+    auto elapsed_time = Clock::now() - t_start;
+    auto time_in_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed_time).count();
+
+    return time_in_ms / 1e+3;
+}
+
+float RayTracer::renderProgressive(ofPixels& pixels, bool parallel, const std::atomic<bool>* cancel)
+{
+    auto t_start = Clock::now();
+    if (accumulated_samples >= settings.progressive_samples) return 0.f;
+
+    // nothing moves while accumulating, the hierarchy only changes after an invalidate
+    if (accumulated_samples == 0){
+        updateSceneHierarchy();
+        accumulation.assign(width * height, glm::vec4(0,0,0,0));
+    }
+
+    // the frame stays the same for the whole accumulation, so the samples
+    // of a pixel walk along one low discrepancy sequence
+    int sample = accumulated_samples;
+    float scale = 1.f / (sample + 1);
+    if (settings.wavefront){
+        wavefront_renderer.resetStats();
+        std::vector<glm::vec4> colors(width * height);
+        wavefront_renderer.renderSample(sample, true, colors.data(), parallel, cancel);
+        for (size_t k = 0; k < colors.size(); k++){
+            accumulation[k] = add_vecs(accumulation[k], colors[k]);
+            colors[k] = scale_vec(scale, accumulation[k]);
+        }
+        storeImage(colors, pixels);
+    }
+    else renderTiles(pixels, parallel, [&](int i, int j){
+        auto& sum = accumulation[j * width + i];
+        sum = add_vecs(sum, getSampleColor(i, j, sample, true));
+        return scale_vec(scale, sum);
+    }, [&](const Tile& block, glm::vec4* colors){
+        if (settings.ray_streams) getStreamColors(block, sample, true, colors);
+        else getBlockColors(block, sample, true, colors);
+        int k = 0;
+        for (int j = block.y0; j < block.y1; j++){
+            for (int i = block.x0; i < block.x1; i++, k++){
+                auto& sum = accumulation[j * width + i];
+                sum = add_vecs(sum, colors[k]);
+                colors[k] = scale_vec(scale, sum);
+            }
+        }
+    }, cancel);
+    // a cancelled pass only added to some of the pixels, the caller is
+    // expected to invalidate before the next one
+    if (cancel && *cancel) return 0.f;
+    accumulated_samples++;
+
     auto elapsed_time = Clock::now() - t_start;
     auto time_in_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed_time).count();
 
     return time_in_ms / 1e+3;
 }
 
+void RayTracer::invalidate()
+{
+    accumulated_samples = 0;
+    frame++;
+}
+
+template<typename PixelType>
+void RayTracer::renderTiles(ofPixels_<PixelType>& pixels, bool parallel, const PixelShader& shade,
+    const BlockShader& shade_block, const std::atomic<bool>* cancel) const
+{
+    auto tiles = getTiles();
+    auto pixel_order = getTilePixelOrder();
+
+    if (parallel){
+        // one tile per task, idle threads steal the tiles left to the busy ones
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, tiles.size(), 1), [&] (const tbb::blocked_range<size_t>& range){
+            for(size_t t = range.begin(); t != range.end(); t++){
+                if (cancel && *cancel) return;
+                renderTile(tiles[t], pixel_order, pixels, shade, shade_block);
+            }
+        });
+    }
+    else{
+        for(const auto& tile: tiles){
+            if (cancel && *cancel) return;
+            renderTile(tile, pixel_order, pixels, shade, shade_block);
+        }
+    }
+}
+
 void RayTracer::addObject(std::shared_ptr<Primitive> obj)
 {
     objects.push_back(obj);
+    rebuild_hierarchy = true;
+    invalidate();
+}
+
+void RayTracer::updateObject(const std::shared_ptr<Primitive>& obj)
+{
+    for (unsigned i = 0; i < objects.size(); i++){
+        if (objects[i] == obj) moved_objects.push_back(i);
+    }
+    invalidate();
 }
 
 void RayTracer::addLight(std::shared_ptr<Light> light)
 {
     lights.push_back(light);
+    invalidate();
 }
 
-ofColor RayTracer::getPixelColor(int i, int j) const
+void RayTracer::updateSceneHierarchy()
 {
-    float new_i = static_cast<float>(i);
-    float new_j = static_cast<float>(j);
+    if (rebuild_hierarchy || hierarchy_builder != settings.bvh_builder){
+        buildSceneHierarchy();
+        return;
+    }
+    if (moved_objects.empty()) return;
+    // spatial splits clip the references to their nodes, so there is nothing to refit
+    if (hierarchy_builder == SPATIAL){
+        buildSceneHierarchy();
+        return;
+    }
 
-    glm::vec4 color(0,0,0,0);
-    std::vector<HitRecord> hit_records;
+    auto start = Clock::now();
+    std::vector<unsigned> changed;
+    for (unsigned i = 0; i < bounded_objects.size(); i++){
+        if (std::find(moved_objects.begin(), moved_objects.end(), bounded_objects[i]) == moved_objects.end()) continue;
+        object_bounds[i] = objects[bounded_objects[i]]->getBounds();
+        changed.push_back(i);
+    }
+    for (auto idx: moved_objects) primitives.update(object_refs[idx], *objects[idx]);
+    moved_objects.clear();
+    scene_bvh.refit(object_bounds, changed);
+
+    // a refitted tree keeps its topology while the objects drift apart,
+    // once its expected cost has grown too much it is cheaper to start over
+    float cost = scene_bvh.getSAHCost();
+    if (cost > hierarchy_cost * (1.f + settings.rebuild_threshold)){
+        ofLogVerbose("RayTracer") << "SAH cost grew from " << hierarchy_cost << " to " << cost << ", rebuilding";
+        buildSceneHierarchy();
+        return;
+    }
+    hierarchy_build_time = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
 
-    //performAntialiasing(new_i, new_j, hit_records);
-    hit_records.push_back(traceRay(new_i, new_j));
-    //HitRecord record = traceRay(new_i, new_j);
-    auto n_records = hit_records.size();
-    for(const auto& record: hit_records){
-        if (record.hit){
-            // perform shading 
-            performShading(record, color);
+void RayTracer::buildSceneHierarchy()
+{
+    auto start = Clock::now();
+    bounded_objects.clear();
+    unbounded_objects.clear();
+    object_bounds.clear();
+
+    for (unsigned i = 0; i < objects.size(); i++){
+        if (objects[i]->isBounded()){
+            bounded_objects.push_back(i);
+            object_bounds.push_back(objects[i]->getBounds());
         }
-        else color[3] += 1.f;
+        else unbounded_objects.push_back(i);
     }
-    
-    color = scale_vec(255.0 / n_records , color);
 
-    return ofColor(color[0], color[1], color[2], color[3]); 
+    scene_bvh.build(object_bounds, settings.bvh_builder);
+    compileObjects();
+    hierarchy_builder = settings.bvh_builder;
+    hierarchy_cost = scene_bvh.getStats().sah_cost;
+    moved_objects.clear();
+    rebuild_hierarchy = false;
+    hierarchy_build_time = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
 
+void RayTracer::compileObjects()
+{
+    primitives.clear();
+    leaf_refs.clear();
+    unbounded_refs.clear();
+    object_refs.assign(objects.size(), PrimitiveArrays::Ref());
+    // spatial splits may list an object in several leaves, it is copied once
+    std::vector<bool> compiled(objects.size(), false);
+
+    auto compile = [&](unsigned idx){
+        if (!compiled[idx]){
+            object_refs[idx] = primitives.add(*objects[idx]);
+            compiled[idx] = true;
+        }
+        return object_refs[idx];
+    };
+    for (auto idx: unbounded_objects) unbounded_refs.push_back(compile(idx));
+    for (auto i: scene_bvh.indices) leaf_refs.push_back(compile(bounded_objects[i]));
 }
 
-HitRecord  RayTracer::traceRay(float x, float y) const
+// position of (x, y) along a space filling curve covering an n x n grid, n a power of two
+static unsigned curveIndex(TileOrder order, unsigned x, unsigned y, unsigned n)
 {
-    auto u = viewport.toU(x, width);
-    auto v = viewport.toV(y, height);
-    Ray ray = camera.rayForPixel(u,v);
-    HitRecord record = testHit(ray);
+    if (order == MORTON){
+        unsigned d = 0;
+        for (unsigned bit = 0; (1u << bit) < n; bit++){
+            d |= ((x >> bit) & 1u) << (2 * bit);
+            d |= ((y >> bit) & 1u) << (2 * bit + 1);
+        }
+        return d;
+    }
+    if (order == HILBERT){
+        // ref: https://en.wikipedia.org/wiki/Hilbert_curve
+        unsigned d = 0;
+        for (unsigned s = n / 2; s > 0; s /= 2){
+            unsigned rx = (x & s) > 0;
+            unsigned ry = (y & s) > 0;
+            d += s * s * ((3 * rx) ^ ry);
+            if (ry == 0){
+                if (rx == 1){
+                    x = n - 1 - x;
+                    y = n - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+    return y * n + x;
+}
 
-    return record;
+// indices y * n + x of an n x n grid sorted along the curve
+static std::vector<unsigned> curveOrder(TileOrder order, unsigned n)
+{
+    unsigned size = 1;
+    while (size < n) size *= 2;
+
+    std::vector<std::pair<unsigned, unsigned>> keys;
+    for (unsigned y = 0; y < n; y++){
+        for (unsigned x = 0; x < n; x++){
+            keys.push_back({curveIndex(order, x, y, size), y * n + x});
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<unsigned> indices;
+    indices.reserve(keys.size());
+    for (const auto& key: keys){
+        indices.push_back(key.second);
+    }
+    return indices;
 }
 
-HitRecord RayTracer::testHit(const Ray& ray) const
+std::vector<RayTracer::Tile> RayTracer::getTiles() const
 {
-    HitRecord closest_so_far;
+    int tile_size = std::max(1, settings.tile_size);
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    int n = std::max(tiles_x, tiles_y);
+
+    // the curve covers a square grid of tiles, the ones off the image are dropped
+    std::vector<Tile> tiles;
+    for (auto idx: curveOrder(settings.tile_order, n)){
+        int tx = idx % n, ty = idx / n;
+        if (tx >= tiles_x || ty >= tiles_y) continue;
+        tiles.push_back({tx * tile_size, ty * tile_size,
+            std::min(width, (tx + 1) * tile_size), std::min(height, (ty + 1) * tile_size)});
+    }
+    return tiles;
+}
+
+std::vector<unsigned> RayTracer::getTilePixelOrder() const
+{
+    return curveOrder(settings.tile_order, std::max(1, settings.tile_size));
+}
+
+template<typename PixelType>
+void RayTracer::storeImage(const std::vector<glm::vec4>& colors, ofPixels_<PixelType>& pixels) const
+{
+    size_t channels = pixels.getNumChannels();
+    size_t color_channels = std::min<size_t>(channels, 4);
+
+    // image rows are stored top down while j grows upwards
+    for (int j = 0; j < height; j++){
+        PixelType* dst = pixels.getData() + (height - j - 1) * width * channels;
+        for (int i = 0; i < width; i++) store_color(dst + i * channels, colors[j * width + i], color_channels);
+    }
+}
 
-    for(const auto& object: objects){
-        HitRecord temp = object->hit(ray);
-        if(temp.t >= EPS){
-            if(temp.t < closest_so_far.t || closest_so_far.t < 0.0){
-                closest_so_far = temp;
+template<typename PixelType>
+void RayTracer::renderTile(const Tile& tile, const std::vector<unsigned>& pixel_order, ofPixels_<PixelType>& pixels,
+    const PixelShader& shade, const BlockShader& shade_block) const
+{
+    int tile_size = std::max(1, settings.tile_size);
+    int tile_w = tile.x1 - tile.x0;
+    int tile_h = tile.y1 - tile.y0;
+    size_t channels = pixels.getNumChannels();
+    size_t color_channels = std::min<size_t>(channels, 4);
+
+    // the tile is shaded into a private buffer so threads never write to the
+    // same cache lines of the image, then copied out one row at a time
+    thread_local std::vector<PixelType> buffer;
+    buffer.resize(tile_w * tile_h * channels);
+
+    if (settings.ray_streams || settings.packet_size > 1){
+        // square blocks of pixels, each traced as one packet, or the whole
+        // tile when its reflection rays are streamed
+        int size = settings.ray_streams ? tile_size : std::min(settings.packet_size, 8);
+        thread_local std::vector<glm::vec4> colors;
+        colors.resize(size * size);
+        for (int by = 0; by < tile_h; by += size){
+            for (int bx = 0; bx < tile_w; bx += size){
+                Tile block = {tile.x0 + bx, tile.y0 + by,
+                    std::min(tile.x1, tile.x0 + bx + size), std::min(tile.y1, tile.y0 + by + size)};
+                shade_block(block, colors.data());
+
+                int k = 0;
+                for (int y = by; y < block.y1 - tile.y0; y++){
+                    for (int x = bx; x < block.x1 - tile.x0; x++, k++){
+                        store_color(&buffer[(y * tile_w + x) * channels], colors[k], color_channels);
+                    }
+                }
             }
         }
     }
+    else for(auto idx: pixel_order){
+        int x = idx % tile_size, y = idx / tile_size;
+        if (x >= tile_w || y >= tile_h) continue;
 
-    return closest_so_far;
+        auto color = shade(tile.x0 + x, tile.y0 + y);
+        store_color(&buffer[(y * tile_w + x) * channels], color, color_channels);
+    }
+
+    // image rows are stored top down while j grows upwards
+    for(int y = 0; y < tile_h; y++){
+        int row = height - (tile.y0 + y) - 1;
+        PixelType* dst = pixels.getData() + (row * width + tile.x0) * channels;
+        std::copy_n(&buffer[y * tile_w * channels], tile_w * channels, dst);
+    }
 }
 
-std::shared_ptr<Primitive> RayTracer::selectObject(int i, int j) const
+glm::vec4 RayTracer::getPixelColor(int i, int j) const
+{
+    glm::vec4 color(0,0,0,0);
+    int n_samples = std::max(1, settings.samples_per_pixel);
+
+    for(int s = 0; s < n_samples; s++){
+        color = add_vecs(color, getSampleColor(i, j, s, n_samples > 1));
+    }
+    return scale_vec(1.f / n_samples, color);
+}
+
+glm::vec2 RayTracer::startSample(int i, int j, int sample, bool jitter) const
 {
     float x = static_cast<float>(i);
     float y = static_cast<float>(j);
+    auto& sampler = Sampler::start(settings.sampler, i, j, sample, frame);
 
+    // the first two dimensions of every sample place it inside the pixel
+    if (jitter){
+        auto offset = sampler.get2D();
+        x += offset[0] - 0.5f;
+        y += offset[1] - 0.5f;
+    }
+    return glm::vec2(x, y);
+}
+
+glm::vec4 RayTracer::getSampleColor(int i, int j, int sample, bool jitter, std::vector<Ray>* deferred_rays) const
+{
+    auto pos = startSample(i, j, sample, jitter);
+
+    glm::vec4 color(0,0,0,0);
+    HitRecord record = traceRay(pos[0], pos[1]);
+    if (record.hit){
+        // perform shading 
+        performShading(record, color, nullptr, deferred_rays);
+    }
+    else color[3] += 1.f;
+
+    return color;
+}
+
+void RayTracer::getBlockColors(const Tile& block, int sample, bool jitter, glm::vec4* colors) const
+{
+    int block_w = block.x1 - block.x0;
+    int n = block_w * (block.y1 - block.y0);
+
+    auto start_sample = [&](int k){
+        return startSample(block.x0 + k % block_w, block.y0 + k / block_w, sample, jitter);
+    };
+
+    RayPacket packet;
+    for (int k = 0; k < n; k++){
+        auto pos = start_sample(k);
+        packet.add(camera.rayForPixel(viewport.toU(pos[0], width), viewport.toV(pos[1], height)));
+    }
+
+    Intersection closest[RayPacket::max_size];
+    HitRecord records[RayPacket::max_size];
+    RayMask hits = testHit(packet, packet.all(), closest);
+    for (RayMask rays = hits; rays; rays &= rays - 1){
+        int k = __builtin_ctzll(rays);
+        records[k] = closest[k].obj->getHitRecord(packet.ray(k), closest[k]);
+    }
+
+    // the shadow rays of the block toward one light start close together and
+    // converge, they are traced as a packet per light
+    std::vector<RayMask> lit(lights.size());
+    for (size_t l = 0; l < lights.size(); l++){
+        RayPacket shadow;
+        float t_max[RayPacket::max_size];
+        for (int k = 0; k < n; k++){
+            shadow.add((hits >> k) & 1 ? getShadowRay(records[k], *lights[l], t_max[k]) : Ray());
+        }
+        lit[l] = hits & ~occluded(shadow, hits, t_max);
+    }
+
+    std::unique_ptr<bool[]> visible(new bool[lights.size()]);
+    for (int k = 0; k < n; k++){
+        start_sample(k);
+        colors[k] = glm::vec4(0,0,0,0);
+        if ((hits >> k) & 1){
+            for (size_t l = 0; l < lights.size(); l++) visible[l] = (lit[l] >> k) & 1;
+            performShading(records[k], colors[k], visible.get());
+        }
+        else colors[k][3] += 1.f;
+    }
+}
+
+void RayTracer::getStreamColors(const Tile& tile, int sample, bool jitter, glm::vec4* colors) const
+{
+    int tile_w = tile.x1 - tile.x0;
+    int n = tile_w * (tile.y1 - tile.y0);
+    size_t pixel_rays = lights.size() * reflection_rays;
+
+    // the pixels are shaded first, without their reflections, and their
+    // reflection rays all go into the stream. The light each ray brings back
+    // is kept apart and added up in the original order once the stream is
+    // traced, so the image is the same as with the rays traced right away.
+    thread_local RayStream stream;
+    thread_local std::vector<Ray> rays;
+    thread_local std::vector<glm::vec4> reflected;
+    // first ray of every pixel in the stream, the next pixel's for those without reflections
+    std::vector<unsigned> first_ray(n + 1, 0);
+    stream.clear();
+    for (int k = 0; k < n; k++){
+        rays.clear();
+        colors[k] = getSampleColor(tile.x0 + k % tile_w, tile.y0 + k / tile_w, sample, jitter, &rays);
+        first_ray[k] = static_cast<unsigned>(stream.size());
+        for (const auto& ray: rays) stream.add(ray, static_cast<unsigned>(stream.size()));
+    }
+    first_ray[n] = static_cast<unsigned>(stream.size());
+    if (stream.size() == 0) return;
+
+    // every pixel with reflections has the rays of all the lights, one after the other
+    reflected.resize(stream.size());
+    auto light_of = [&](unsigned id){
+        return lights[id % pixel_rays / reflection_rays];
+    };
+    stream.trace([&](const RayPacket& packet, const unsigned* ids){
+        Intersection closest[RayPacket::max_size];
+        HitRecord records[RayPacket::max_size];
+        RayPacket shadow;
+        float t_max[RayPacket::max_size];
+        RayMask hits = testHit(packet, packet.all(), closest);
+        for (int k = 0; k < packet.size; k++){
+            reflected[ids[k]] = glm::vec4(0,0,0,0);
+            if ((hits >> k) & 1){
+                records[k] = closest[k].obj->getHitRecord(packet.ray(k), closest[k]);
+                shadow.add(getShadowRay(records[k], *light_of(ids[k]), t_max[k]));
+            }
+            else shadow.add(Ray());
+        }
+
+        RayMask lit = hits & ~occluded(shadow, hits, t_max);
+        for (RayMask rays = hits; rays; rays &= rays - 1){
+            int k = __builtin_ctzll(rays);
+            bool visible = (lit >> k) & 1;
+            reflected[ids[k]] = getReflectedColor(records[k], light_of(ids[k]), &visible);
+        }
+    });
+
+    // as in performShading, the reflections toward every light come first
+    // and the shaded color of the object is added on top
+    for (int k = 0; k < n; k++){
+        if (first_ray[k] == first_ray[k + 1]) continue;
+        glm::vec4 color(0,0,0,0);
+        for (size_t l = 0; l < lights.size(); l++){
+            color = add_vecs(color, averageReflections(&reflected[first_ray[k] + l * reflection_rays]));
+        }
+        colors[k] = clamp(add_vecs(color, colors[k]), 0.0, 1.0);
+    }
+}
+
+HitRecord  RayTracer::traceRay(float x, float y) const
+{
     auto u = viewport.toU(x, width);
     auto v = viewport.toV(y, height);
     Ray ray = camera.rayForPixel(u,v);
-    HitRecord closest_so_far;
-
-    std::shared_ptr<Primitive> closest_obj = nullptr;
-    for(const auto& object: objects){
-        HitRecord temp = object->hit(ray);
-        if(temp.hit && temp.t > EPS){
-            if(closest_so_far.t < 0.0 || temp.t < closest_so_far.t){
-                closest_so_far = temp;
-                closest_obj = object;
-            }
+    HitRecord record = testHit(ray);
+
+    return record;
+}
+
+HitRecord RayTracer::testHit(const Ray& ray) const
+{
+    Intersection closest;
+    float t_max = INFINITY;
+
+    // unbounded objects first, their hits clip the hierarchy traversal
+    primitives.intersect(unbounded_refs.data(), static_cast<unsigned>(unbounded_refs.size()), ray, t_max, closest);
+    scene_bvh.traverseLeaves(ray, t_max, [&](unsigned first, unsigned count, float& t_max){
+        primitives.intersect(&leaf_refs[first], count, ray, t_max, closest);
+    });
+
+    if(!closest.obj) return HitRecord();
+    return closest.obj->getHitRecord(ray, closest);
+}
+
+bool RayTracer::occluded(const Ray& ray, float t_max) const
+{
+    if (primitives.occluded(unbounded_refs.data(), static_cast<unsigned>(unbounded_refs.size()), ray, t_max)) return true;
+
+    return scene_bvh.occludedLeaves(ray, t_max, [&](unsigned first, unsigned count){
+        return primitives.occluded(&leaf_refs[first], count, ray, t_max);
+    });
+}
+
+RayMask RayTracer::testHit(const RayPacket& packet, RayMask active, Intersection* closest) const
+{
+    float t_max[RayPacket::max_size];
+    for (int k = 0; k < packet.size; k++){
+        t_max[k] = INFINITY;
+        closest[k] = Intersection();
+    }
+
+    RayMask hits = 0;
+    auto intersect = [&](PrimitiveArrays::Ref ref, RayMask rays, float* t_max){
+        RayMask hit = primitives.visit(ref, [&](const auto& obj){ return obj.intersectPacket(packet, rays, t_max, closest); });
+        hits |= hit;
+        for (; hit; hit &= hit - 1){
+            int k = __builtin_ctzll(hit);
+            t_max[k] = closest[k].t;
         }
+    };
+
+    for(auto ref: unbounded_refs){
+        intersect(ref, active, t_max);
     }
+    scene_bvh.traversePacket(packet, active, t_max, [&](unsigned first, unsigned count, RayMask rays, float* t_max){
+        for (unsigned i = first; i < first + count; i++) intersect(leaf_refs[i], rays, t_max);
+    });
 
-    return closest_obj;
+    return hits;
 }
 
-void RayTracer::performAntialiasing(float x, float y, std::vector<HitRecord>& arr) const
+RayMask RayTracer::occluded(const RayPacket& packet, RayMask active, const float* t_max) const
 {
-    int n = 4;
-    std::random_device rd;  //Will be used to obtain a seed for the random number engine
-    std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-    std::uniform_real_distribution<> dis(0, 1.0);
+    auto occludes = [&](PrimitiveArrays::Ref ref, RayMask rays){
+        return primitives.visit(ref, [&](const auto& obj){ return obj.occludedPacket(packet, rays, t_max); });
+    };
 
-    for (int i = 0; i < n; i++){
-        for (int j = 0; j < n; j++){
-            auto sign = (i % 2) ? 1.f : -1.f;
-            float rand_i = static_cast<float>(dis(gen));
-            float rand_j = static_cast<float>(dis(gen));
-            x += sign * (i + rand_i) / n;
-            y += sign * (j + rand_j) / n;
+    RayMask blocked = 0;
+    for(auto ref: unbounded_refs){
+        blocked |= occludes(ref, active & ~blocked);
+    }
+    if (blocked == active) return blocked;
 
-            auto hit_record = traceRay(x, y);
-            arr.push_back(hit_record);
+    return blocked | scene_bvh.occludedPacket(packet, active & ~blocked, t_max, [&](unsigned first, unsigned count, RayMask rays){
+        RayMask hit = 0;
+        for (unsigned i = first; i < first + count && hit != rays; i++){
+            hit |= occludes(leaf_refs[i], rays & ~hit);
         }
-    }
+        return hit;
+    });
 }
 
-glm::vec4 RayTracer::getIntensity(const HitRecord& record, const std::shared_ptr<Light>& light) const
+std::shared_ptr<Primitive> RayTracer::selectObject(int i, int j) const
 {
-    std::random_device rd;  //Will be used to obtain a seed for the random number engine
-    std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-    std::uniform_real_distribution<> dis(0, 0.1);
+    float x = static_cast<float>(i);
+    float y = static_cast<float>(j);
+
+    auto u = viewport.toU(x, width);
+    auto v = viewport.toV(y, height);
+    Ray ray = camera.rayForPixel(u,v);
+    HitRecord record = testHit(ray);
+    if (!record.hit) return nullptr;
 
-    auto jittered_pos = add_vecs(light->position, glm::vec3(dis(gen),dis(gen),dis(gen)));
+    // hits are on the traced copies of the objects
+    for(size_t i = 0; i < object_refs.size(); i++){
+        if(&primitives.get(object_refs[i]) == record.obj) return objects[i];
+    }
 
-    auto l = subtract_vecs(light->position, record.p);
-    float l_dist = vec_length(l);
-    l = normalize(l);
+    return nullptr;
+}
 
-    Ray ray(record.p,l);
-    auto shadow_record = testHit(ray);
+Ray RayTracer::getShadowRay(const HitRecord& record, const Light& light, float& t_max) const
+{
+    auto l = subtract_vecs(light.position, record.p);
+    t_max = vec_length(l);
+    return Ray(record.p, normalize(l));
+}
 
-    if(!shadow_record.hit || l_dist < shadow_record.t){
-        float angle = dot_product(record.n, l);
+glm::vec4 RayTracer::getIntensity(const HitRecord& record, const std::shared_ptr<Light>& light, const bool* visible) const
+{
+    float l_dist;
+    Ray ray = getShadowRay(record, *light, l_dist);
+    if(visible ? *visible : !occluded(ray, l_dist)){
+        float angle = dot_product(record.n, ray.d);
         return light->getIllumination(angle);
     }
 
     return glm::vec4(0,0,0,1.0);
 }
 
+void RayTracer::getReflectionRays(const HitRecord& record, Ray* rays) const
+{
+    auto& sampler = Sampler::get();
+    auto scale = 2.f * dot_product(record.ray.d, record.n);
+    auto norm_scaled = scale_vec(scale, record.n);
+    auto diff = subtract_vecs(record.ray.d, norm_scaled);
+    auto reflect_vec = hadamard_product(diff,glm::vec3(1/3.0, 1.f, 1/2.0));
+    // nudged off the surface so the rays do not hit it again
+    auto reflect_org = add_vecs(record.p, scale_vec(EPS, record.n));
+
+    // every direction is drawn before any ray is traced, so the rays are the
+    // same whether they are traced here or later on in a stream
+    for (int i = 0; i < reflection_rays; i++){
+        // drawn one by one, the order of evaluation of arguments is unspecified
+        float x = sampler.get1D(), y = sampler.get1D(), z = sampler.get1D();
+        auto random_vec = glm::vec3(0.25 * x, 0.125 * y, 0.25 * z);
+        auto reflect_dir = normalize(add_vecs(reflect_vec, random_vec));
+        rays[i] = Ray(reflect_org, reflect_dir);
+    }
+}
+
 glm::vec4 RayTracer::getReflectionColor(const HitRecord& record, const std::shared_ptr<Light>& light) const
 {
-    int n_reflect = 64;
-    glm::vec4 color(0.0, 0.0, 0.0, 0.0);
-    std::random_device rd;  //Will be used to obtain a seed for the random number engine
-    std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
-    std::uniform_real_distribution<> dis(0, 1.0);
-    
-    for (int i = 0; i < n_reflect; i++){
-        auto scale = 2.f * dot_product(record.ray.d, record.n);
-        auto norm_scaled = scale_vec(scale, record.n);
-        auto diff = subtract_vecs(record.ray.d, norm_scaled);
-        auto reflect_vec = hadamard_product(diff,glm::vec3(1/3.0, 1.f, 1/2.0));
-        auto random_vec = glm::vec3(0.25 * dis(gen), 0.125 * dis(gen), 0.25 * dis(gen));
+    Ray rays[reflection_rays];
+    glm::vec4 reflected[reflection_rays];
+    getReflectionRays(record, rays);
 
-        auto reflect_dir = normalize(add_vecs(reflect_vec, random_vec));
-        auto reflect_org = add_vecs(record.p, record.n);
-        Ray ray(reflect_org, reflect_dir);
-        auto reflect_record = testHit(ray);
+    for (int i = 0; i < reflection_rays; i++){
+        reflected[i] = glm::vec4(0,0,0,0);
+        auto reflect_record = testHit(rays[i]);
         if (reflect_record.hit){
-            reflect_record.n *= -1.f;
-            reflect_record.p *= -1.f;
-
-            auto intensity = getIntensity(reflect_record, light);
-            intensity = scale_vec(0.8,intensity);
-            auto object_color = reflect_record.obj->getColor();
-            auto obj_vcolor = glm::vec4(object_color.r,object_color.g,object_color.b, object_color.a);
-            obj_vcolor = hadamard_product(obj_vcolor,intensity);
-            obj_vcolor = clamp(obj_vcolor,0.0, 1.0);
-            color = add_vecs(color,obj_vcolor);
+            reflected[i] = getReflectedColor(reflect_record, light);
         }
     }
 
-    color = scale_vec(1.0/n_reflect, color);
+    return averageReflections(reflected);
+}
+
+glm::vec4 RayTracer::getReflectedColor(const HitRecord& reflect_record, const std::shared_ptr<Light>& light, const bool* visible) const
+{
+    auto intensity = getIntensity(reflect_record, light, visible);
+    intensity = scale_vec(0.8,intensity);
+    auto object_color = reflect_record.obj->getHitColor(reflect_record);
+    auto obj_vcolor = glm::vec4(object_color.r,object_color.g,object_color.b, object_color.a);
+    obj_vcolor = hadamard_product(obj_vcolor,intensity);
+    return clamp(obj_vcolor,0.0, 1.0);
+}
+
+glm::vec4 RayTracer::averageReflections(const glm::vec4* reflected) const
+{
+    glm::vec4 color(0.0, 0.0, 0.0, 0.0);
+    for (int i = 0; i < reflection_rays; i++){
+        color = add_vecs(color, reflected[i]);
+    }
+
+    color = scale_vec(1.0/reflection_rays, color);
     color[3] = 1.f;
     return clamp(color,0.0,1.0);
 }
 
-void RayTracer::performShading(const HitRecord& record, glm::vec4& color) const
+void RayTracer::performShading(const HitRecord& record, glm::vec4& color, const bool* visible,
+    std::vector<Ray>* deferred_rays) const
+{
+    //reflection
+    if (settings.reflections && record.obj->isReflectEnabled()){
+        for(const auto& light: lights){
+            if (deferred_rays){
+                deferred_rays->resize(deferred_rays->size() + reflection_rays);
+                getReflectionRays(record, &*(deferred_rays->end() - reflection_rays));
+            }
+            else{
+                auto reflect_color = getReflectionColor(record, light);
+                color = add_vecs(color, reflect_color);
+            }
+        }
+    }
+
+    color = add_vecs(color, getObjectColor(record, visible));
+    color = clamp(color, 0.0, 1.0);
+}
+
+glm::vec4 RayTracer::getObjectColor(const HitRecord& record, const bool* visible) const
 {
     int num_shadow_rays = 1;
     auto illumination = ambient_light.light;
 
-    for(const auto& light: lights){
+    for(size_t l = 0; l < lights.size(); l++){
+        const auto& light = lights[l];
         auto intensity = glm::vec4(0,0,0,0);
         for (int j=0; j < num_shadow_rays; j++){
-             intensity = add_vecs(intensity,getIntensity(record, light));
+             intensity = add_vecs(intensity,getIntensity(record, light, visible ? &visible[l] : nullptr));
         }
         intensity = scale_vec(1.f/num_shadow_rays,intensity);
         intensity[3] = 1;
         illumination = add_vecs(illumination, intensity);
-        //reflection
-        /*
-        if (record.obj->isReflectEnabled()){
-            auto reflect_color = getReflectionColor(record, light);
-            color = add_vecs(color, reflect_color);
-        }*/
-    }
-    auto object_color = record.obj->getColor();
+    }
+    auto object_color = record.obj->getHitColor(record);
     auto obj_vcolor = glm::vec4(object_color.r,object_color.g,object_color.b, object_color.a);
     obj_vcolor = hadamard_product(obj_vcolor,illumination);
-    obj_vcolor = clamp(obj_vcolor,0.0, 1.0);
-
-    color = add_vecs(color, obj_vcolor);
-    //reflection
-    color = clamp(color, 0.0, 1.0);
+    return clamp(obj_vcolor,0.0, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,127 @@
+#include "rtRenderSession.h"
+
+RenderSession::RenderSession(RayTracer& raytracer, int width, int height, bool progressive):
+    raytracer(raytracer), stopping(false), needs_frame(true), frame_ready(false),
+    progressive(progressive), cancel(false), render_time(0.f), hierarchy_build_time(0.f), accumulated_samples(0) {
+
+    back_buffer.allocate(width, height, OF_PIXELS_RGB);
+    front_buffer.allocate(width, height, OF_PIXELS_RGB);
+}
+
+RenderSession::~RenderSession()
+{
+    stop();
+}
+
+void RenderSession::start()
+{
+    if (worker.joinable()) return;
+    stopping = false;
+    worker = std::thread(&RenderSession::run, this);
+}
+
+void RenderSession::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        cancel = true;
+    }
+    wake.notify_one();
+    if (worker.joinable()) worker.join();
+}
+
+void RenderSession::edit(std::function<bool()> change)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(change));
+        cancel = true;
+    }
+    wake.notify_one();
+}
+
+void RenderSession::query(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back([task]{ task(); return false; });
+    }
+    wake.notify_one();
+}
+
+bool RenderSession::fetchFrame(ofPixels& pixels)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!frame_ready) return false;
+
+    // the caller's previous frame becomes the next spare buffer
+    pixels.swap(front_buffer);
+    frame_ready = false;
+    return true;
+}
+
+void RenderSession::setProgressive(bool enable)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        progressive = enable;
+        needs_frame = true;
+    }
+    wake.notify_one();
+}
+
+bool RenderSession::hasWork() const
+{
+    if (progressive) return raytracer.getAccumulatedSamples() < raytracer.settings.progressive_samples;
+    return needs_frame;
+}
+
+void RenderSession::run()
+{
+    // a cancelled progressive pass added to some of the pixels only
+    bool cancelled = false;
+    while (true){
+        std::vector<Task> tasks;
+        bool full_frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{ return stopping || !pending.empty() || hasWork(); });
+            if (stopping) return;
+
+            // everything queued while the last pass ran is applied at once
+            tasks.swap(pending);
+            cancel = false;
+        }
+
+        bool invalidated = cancelled;
+        for (auto& task: tasks) invalidated |= task();
+        if (invalidated){
+            cancelled = false;
+            raytracer.invalidate();
+            std::lock_guard<std::mutex> lock(mutex);
+            needs_frame = true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!hasWork()) continue;
+            full_frame = !progressive;
+            needs_frame = false;
+        }
+
+        float time = full_frame ? raytracer.render(back_buffer, true, &cancel)
+            : raytracer.renderProgressive(back_buffer, true, &cancel);
+        if (cancel){
+            cancelled = true;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        back_buffer.swap(front_buffer);
+        frame_ready = true;
+        render_time = time;
+        hierarchy_build_time = raytracer.getHierarchyBuildTime();
+        accumulated_samples = raytracer.getAccumulatedSamples();
+    }
+}
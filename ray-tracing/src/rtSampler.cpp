@@ -0,0 +1,302 @@
+#include "rtSampler.h"
+
+static inline uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+static inline float to_unit_float(uint32_t x)
+{
+    return (x >> 8) * 0x1p-24f;
+}
+
+static inline float fract(float x)
+{
+    return x - std::floor(x);
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+void Sampler::startPixelSample(int x, int y, int sample, int frame)
+{
+    px = x;
+    py = y;
+    sample_index = sample;
+    dimension = 0;
+
+    uint64_t pixel = (static_cast<uint64_t>(y) << 32) | static_cast<uint32_t>(x);
+    uint64_t index = (static_cast<uint64_t>(frame) << 32) | static_cast<uint32_t>(sample);
+    frame_seed = mix_bits(static_cast<uint64_t>(frame) + 0x9e3779b97f4a7c15ULL);
+    pixel_seed = mix_bits(pixel ^ frame_seed);
+    rng.seed(mix_bits(pixel ^ mix_bits(index)), mix_bits(index));
+}
+
+static thread_local Sampler* current_sampler = nullptr;
+
+Sampler& Sampler::start(SamplerType type, int x, int y, int sample, int frame)
+{
+    thread_local UniformSampler uniform;
+    thread_local HaltonSampler halton;
+    thread_local SobolSampler sobol;
+    thread_local BlueNoiseSampler blue_noise;
+
+    switch(type){
+        case HALTON: current_sampler = &halton; break;
+        case SOBOL: current_sampler = &sobol; break;
+        case BLUE_NOISE: current_sampler = &blue_noise; break;
+        default: current_sampler = &uniform; break;
+    }
+
+    current_sampler->startPixelSample(x, y, sample, frame);
+    return *current_sampler;
+}
+
+Sampler& Sampler::get()
+{
+    if (!current_sampler) return start(UNIFORM, 0, 0, 0, 0);
+    return *current_sampler;
+}
+
+const char* Sampler::getName(SamplerType type)
+{
+    switch(type){
+        case HALTON: return "halton";
+        case SOBOL: return "sobol";
+        case BLUE_NOISE: return "blue-noise";
+        default: return "uniform";
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+glm::vec2 UniformSampler::get2D()
+{
+    float x = rng.uniform();
+    return glm::vec2(x, rng.uniform());
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+static inline uint32_t sobol_dim0(uint32_t index)
+{
+    return reverse_bits(index);
+}
+
+static inline uint32_t sobol_dim1(uint32_t index)
+{
+    uint32_t r = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1){
+        if (index & 1) r ^= v;
+    }
+    return r;
+}
+
+static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+static inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    return reverse_bits(x);
+}
+
+float SobolSampler::get1D()
+{
+    uint64_t hash = mix_bits(pixel_seed + dimension++);
+    uint32_t index = nested_uniform_scramble(sample_index, static_cast<uint32_t>(hash));
+    return to_unit_float(nested_uniform_scramble(sobol_dim0(index), static_cast<uint32_t>(hash >> 32)));
+}
+
+glm::vec2 SobolSampler::get2D()
+{
+    uint64_t hash = mix_bits(pixel_seed + dimension);
+    dimension += 2;
+    uint32_t index = nested_uniform_scramble(sample_index, static_cast<uint32_t>(hash));
+    uint32_t x = nested_uniform_scramble(sobol_dim0(index), static_cast<uint32_t>(hash >> 32));
+    uint32_t y = nested_uniform_scramble(sobol_dim1(index), static_cast<uint32_t>(mix_bits(hash)));
+    return glm::vec2(to_unit_float(x), to_unit_float(y));
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+static const uint32_t primes[HaltonSampler::max_dimension] = {
+    2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+    59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+};
+
+float HaltonSampler::scrambledRadicalInverse(int dim, uint32_t index) const
+{
+    const uint32_t base = primes[dim];
+    const double inv_base = 1.0 / base;
+    double inv_base_n = 1.0, value = 0.0;
+    uint64_t hash = mix_bits(pixel_seed ^ (static_cast<uint64_t>(dim + 1) << 40));
+
+    // every digit is shifted by a hash of the digits before it
+    while (index){
+        uint32_t digit = index % base;
+        index /= base;
+        uint32_t shift = static_cast<uint32_t>(((hash >> 32) * base) >> 32);
+        uint32_t scrambled = digit + shift < base ? digit + shift : digit + shift - base;
+        inv_base_n *= inv_base;
+        value += scrambled * inv_base_n;
+        // a cheap multiply-xorshift is enough to decorrelate the next digit
+        hash = (hash ^ (digit + 1)) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    // scrambling the trailing zero digits turns them into a uniform remainder
+    value += (hash >> 40) * 0x1p-24 * inv_base_n;
+
+    return std::min(static_cast<float>(value), 0x1.fffffep-1f);
+}
+
+float HaltonSampler::get1D()
+{
+    if (dimension >= max_dimension) return rng.uniform();
+    return scrambledRadicalInverse(dimension++, sample_index);
+}
+
+glm::vec2 HaltonSampler::get2D()
+{
+    float x = get1D();
+    return glm::vec2(x, get1D());
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+float BlueNoiseSampler::maskValue(int offset_x, int offset_y) const
+{
+    const auto& mask = getMask();
+    int x = (px + offset_x) & (mask_size - 1);
+    int y = (py + offset_y) & (mask_size - 1);
+    return mask[y * mask_size + x];
+}
+
+float BlueNoiseSampler::get1D()
+{
+    // the same shift for every pixel keeps the spatial structure of the mask
+    uint64_t hash = mix_bits(frame_seed + dimension++);
+    float offset = maskValue(hash & 0xff, (hash >> 8) & 0xff);
+    return fract(offset + sample_index * 0.618033988749894848f);
+}
+
+glm::vec2 BlueNoiseSampler::get2D()
+{
+    uint64_t hash = mix_bits(frame_seed + dimension);
+    dimension += 2;
+    float offset_x = maskValue(hash & 0xff, (hash >> 8) & 0xff);
+    float offset_y = maskValue((hash >> 16) & 0xff, (hash >> 24) & 0xff);
+
+    // R2 sequence, ref: http://extremelearning.com.au/unreasonable-effectiveness-of-quasirandom-sequences/
+    return glm::vec2(
+        fract(offset_x + sample_index * 0.754877666246692760f),
+        fract(offset_y + sample_index * 0.569840290998053265f)
+    );
+}
+
+const std::vector<float>& BlueNoiseSampler::getMask()
+{
+    static const std::vector<float> mask = generateMask();
+    return mask;
+}
+
+std::vector<float> BlueNoiseSampler::generateMask()
+{
+    // ref: Ulichney, "The void-and-cluster method for dither array generation", 1993
+    const int n = mask_size;
+    const int count = n * n;
+    const float sigma = 1.5f;
+
+    // toroidal gaussian energy filter, indexed by the offset between two pixels
+    std::vector<float> kernel(count);
+    for (int dy = 0; dy < n; dy++){
+        for (int dx = 0; dx < n; dx++){
+            float x = std::min(dx, n - dx);
+            float y = std::min(dy, n - dy);
+            kernel[dy * n + dx] = std::exp(-(x * x + y * y) / (2.f * sigma * sigma));
+        }
+    }
+
+    std::vector<char> pattern(count, 0);
+    std::vector<float> energy(count, 0.f);
+    auto toggle = [&](int idx){
+        float sign = pattern[idx] ? -1.f : 1.f;
+        pattern[idx] = !pattern[idx];
+        int ix = idx % n, iy = idx / n;
+        for (int y = 0; y < n; y++){
+            for (int x = 0; x < n; x++){
+                energy[y * n + x] += sign * kernel[((y - iy) & (n - 1)) * n + ((x - ix) & (n - 1))];
+            }
+        }
+    };
+    auto tightestCluster = [&](){
+        int best = -1;
+        for (int i = 0; i < count; i++){
+            if (pattern[i] && (best < 0 || energy[i] > energy[best])) best = i;
+        }
+        return best;
+    };
+    auto largestVoid = [&](){
+        int best = -1;
+        for (int i = 0; i < count; i++){
+            if (!pattern[i] && (best < 0 || energy[i] < energy[best])) best = i;
+        }
+        return best;
+    };
+
+    // initial binary pattern: random points relaxed until moving the
+    // tightest cluster would put it straight back into the largest void
+    PCG32 rng(1, 1);
+    const int initial_points = count / 10;
+    for (int placed = 0; placed < initial_points;){
+        int idx = rng.next() % count;
+        if (pattern[idx]) continue;
+        toggle(idx);
+        placed++;
+    }
+    while (true){
+        int cluster = tightestCluster();
+        toggle(cluster);
+        int void_idx = largestVoid();
+        toggle(void_idx);
+        if (void_idx == cluster) break;
+    }
+
+    std::vector<int> rank(count);
+    auto initial_pattern = pattern;
+    auto initial_energy = energy;
+
+    // rank the initial points by repeatedly removing the tightest cluster
+    for (int r = initial_points - 1; r >= 0; r--){
+        int cluster = tightestCluster();
+        toggle(cluster);
+        rank[cluster] = r;
+    }
+
+    // then fill the largest void until the mask is full
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (int r = initial_points; r < count; r++){
+        int void_idx = largestVoid();
+        toggle(void_idx);
+        rank[void_idx] = r;
+    }
+
+    std::vector<float> mask(count);
+    for (int i = 0; i < count; i++){
+        mask[i] = (rank[i] + 0.5f) / count;
+    }
+    return mask;
+}
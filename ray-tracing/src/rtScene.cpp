@@ -0,0 +1,238 @@
+#include "rtScene.h"
+#include <fstream>
+#include <sstream>
+#include "rtTransformation.h"
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+Scene::Scene(int width, int height):
+    compress_meshes(false), build_time(0.f) {
+
+    // Initialize lights
+    AmbientLight ambient_light(0.3, ofFloatColor(1,1,1,1));
+    std::shared_ptr<Light> light1, light2, light3;
+    light1 = std::make_shared<Light>(glm::vec3(0.0, 5.0, 0), 0.7,ofFloatColor(1,1,1,1));
+    //light2 = std::make_shared<Light>(glm::vec3(-1, 0.5, 1), 0.7, ofFloatColor(1,1,1,1));
+    light3 = std::make_shared<Light>(glm::vec3(-0.5, 0.4, -0.2), 0.7, ofFloatColor(1,1,1,1));
+
+
+    // Initialize primitives
+
+    plane = std::make_shared<Plane>(glm::vec3(0, -1.4, 0), glm::vec3(0, 1, 0),0,ofFloatColor(0.5, 0.5, 0.5));
+    cone = std::make_shared<Cone>(glm::vec3(0.9, 0.5, 0.0), glm::vec3(0.9, -1.4, 0.0), 0.26, 0.5, ofFloatColor(1, 0, 0));
+    cylinder = std::make_shared<Cylinder>(glm::vec3(-1.2, 1, -1.2), glm::vec3(-1.2, -1, -1.2), 0.15,1,ofFloatColor(0, 0, 1));
+    sphere = std::make_shared<Sphere>(1.2, glm::vec3(-0.7, -0.5, 1),0.9,ofFloatColor(0, 1, 0));
+
+    //cone = std::make_shared<Cone>(glm::vec3(-1.0, -0.3, -1), glm::vec3(-0.5, -1, -1), 0.26, 0.5, ofFloatColor(1, 1, 0, 1));
+    //sphere = std::make_shared<Sphere>(0.5, glm::vec3(2.5, -0.3, -0.2),0.9,ofFloatColor(0, 1, 0, 1));
+
+    // Initialize Camera
+    camera = std::make_unique<Camera>(glm::vec3(0, 0.5, -3), glm::vec3(0,0,1),glm::vec3(1,0,0));
+    
+    // Initialize Raytracer
+    raytracer = std::make_unique<RayTracer>(width, height,*camera,Viewport(2.0, 1.5), ambient_light);
+    raytracer->addLight(light1);
+    //raytracer.addLight(light2);
+    raytracer->addLight(light3);
+    
+    raytracer->addObject(plane);
+    //raytracer->addObject(cone);
+    raytracer->addObject(sphere);
+    //raytracer->addObject(cylinder);
+}
+
+bool Scene::loadObjModels(const std::string& filename, const glm::vec3& position) {
+
+  // the meshes of a file are loaded once, every call after that only adds instances
+  auto& models = meshes[filename];
+  if (models.empty() && !loadMeshes(filename, models)) return false;
+
+  auto to_world = Transform(translation(position[0], position[1], position[2])) * Transform(rotation_y(M_PI_2));
+  for (const auto& model: models){
+    raytracer->addObject(std::make_shared<Instance>(model, to_world));
+  }
+
+  return true;
+}
+
+bool Scene::loadMeshes(const std::string& filename, std::vector<std::shared_ptr<Model>>& models) {
+
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::string warn, err;
+
+  bool ret = tinyobj::LoadObj(&attrib, &shapes, nullptr, &warn, &err, filename.c_str());
+
+  for (size_t s = 0; s < shapes.size(); s++) {
+    
+    std::shared_ptr<Model> model = std::make_shared<Model>(ofFloatColor(1,0,0,1));
+    std::vector<glm::vec3> vert_norm(attrib.vertices.size(), glm::vec3(0.f, 0.f, 0.f));
+
+    min_x = min_y = min_z = INFINITY;
+    max_x = max_y = max_z = -INFINITY;
+
+    size_t index_offset = 0;
+    for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
+      Triangle triangle;
+      int fv = shapes[s].mesh.num_face_vertices[f];
+
+      unsigned index[3] = {0, 0, 0};
+      for (int v = 0; v < fv; v++) {
+        const tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+        index[v] = idx.vertex_index;
+
+        auto vertex = glm::vec3(
+            attrib.vertices[3*idx.vertex_index+0],
+            attrib.vertices[3*idx.vertex_index+1],
+            attrib.vertices[3*idx.vertex_index+2]
+        );
+        
+        // load provided normals
+        auto normal = glm::vec3(
+            attrib.normals[3*idx.normal_index+0],
+            attrib.normals[3*idx.normal_index+1],
+            attrib.normals[3*idx.normal_index+2]
+        );
+
+        model->vertices.push_back(vertex);
+        model->normals.push_back(normal);
+        triangle.vertices[v] = model->vertices.size() - 1;
+        
+        updateMinMax(vertex[0], vertex[1], vertex[2]);
+      }
+
+      index_offset += fv;
+      model->triangles.push_back(triangle);
+
+      auto A = model->vertices[triangle.vertices[0]];
+      auto B = model->vertices[triangle.vertices[1]];
+      auto C = model->vertices[triangle.vertices[2]];
+
+      // Compute Normals from vertices instead of from the given values
+      auto edge1 = subtract_vecs(A, B); 
+      auto edge2 = subtract_vecs(A, C);
+
+      // ref: https://www.iquilezles.org/www/articles/normals/normals.htm
+      auto no = normalize(cross_product(edge1,edge2));
+      vert_norm[index[0]] += no; vert_norm[index[1]] += no; vert_norm[index[2]] += no;
+    }
+
+    index_offset = 0;
+    for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
+      int fv = shapes[s].mesh.num_face_vertices[f];
+      for (int v = 0; v < fv; v++) {
+        const tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+        model->pnormals.push_back(normalize(vert_norm[idx.vertex_index]));
+      }
+      index_offset += fv;
+    }
+
+    
+    const float radius = std::max(max_x, std::max(max_y, max_z)) - std::min(min_x, std::min(min_y, min_z));
+    auto b1 = glm::vec3(min_x, min_y, min_z);
+    auto b2 = glm::vec3(max_x, max_y, max_z);
+
+    model->bounding_sphere = Sphere(radius, glm::vec3(0,0,0), 0, ofFloatColor(0,1,0,1));
+    model->bbox = BBox(b1, b2);
+
+    auto build_start = Clock::now();
+    // a mesh to be compressed never gets the float triangle blocks, the
+    // largest part of the float layout
+    model->build(raytracer->settings.bvh_builder, !compress_meshes);
+    auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - build_start).count();
+    build_time += build_ms / 1e+3;
+
+    auto stats = model->bvh.getStats();
+    ofLogNotice("loadObjModels") << filename << ": " << model->triangles.size() << " triangles, "
+        << stats.nodes << " nodes, " << stats.leaves << " leaves (avg " << stats.avg_leaf_size
+        << ", max " << stats.max_leaf_size << " triangles), depth " << stats.max_depth
+        << ", SAH cost " << stats.sah_cost << ", built in " << build_ms << " ms";
+
+    // same mesh with object splits only, to see what the spatial splits bought
+    if (raytracer->settings.bvh_builder == SPATIAL){
+        BVH object_split;
+        object_split.build(model->getTriangleBounds(), BINNED_SAH);
+        float object_cost = object_split.getStats().sah_cost;
+        ofLogNotice("loadObjModels") << filename << ": spatial splits lower the SAH cost from " << object_cost
+            << " to " << stats.sah_cost << " (" << 100.f * (object_cost - stats.sah_cost) / object_cost
+            << "%) with " << stats.references << " references ("
+            << 100.f * (stats.references - model->triangles.size()) / model->triangles.size() << "% more)";
+    }
+
+    if (compress_meshes){
+        if (model->compress()){
+            ofLogNotice("loadObjModels") << filename << ": compressed to " << model->memoryUsage() << " bytes";
+        }
+        else{
+            ofLogWarning("loadObjModels") << filename << ": leaves too large to compress";
+            model->buildBlocks();
+        }
+    }
+    
+    models.push_back(model);
+  }
+
+  return ret && !models.empty();
+}
+
+bool Scene::loadSphereCloud(const std::string& filename, const glm::vec3& position, float radius) {
+
+  std::ifstream file(filename);
+  if (!file) return false;
+
+  auto cloud = std::make_shared<SphereCloud>(0.5, ofFloatColor(1, 1, 1, 1));
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') continue;
+
+    std::istringstream values(line);
+    std::vector<float> v;
+    for (float x; values >> x;) v.push_back(x);
+
+    glm::vec3 center(v.size() > 0 ? v[0] : 0.f, v.size() > 1 ? v[1] : 0.f, v.size() > 2 ? v[2] : 0.f);
+    // a radius of its own has to be positive
+    switch (v.size()) {
+      case 3: cloud->add(center, radius); continue;
+      case 4: if (v[3] > 0.f){ cloud->add(center, v[3]); continue; } break;
+      case 6: cloud->add(center, radius, ofFloatColor(v[3] / 255.f, v[4] / 255.f, v[5] / 255.f, 1)); continue;
+      case 7: if (v[3] > 0.f){ cloud->add(center, v[3], ofFloatColor(v[4] / 255.f, v[5] / 255.f, v[6] / 255.f, 1)); continue; } break;
+    }
+    ofLogWarning("loadSphereCloud") << filename << ": skipping line \"" << line << "\"";
+  }
+  if (cloud->size() == 0) return false;
+
+  auto build_start = Clock::now();
+  cloud->build(raytracer->settings.bvh_builder);
+  auto build_ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - build_start).count();
+  build_time += build_ms / 1e+3;
+
+  auto stats = cloud->bvh.getStats();
+  ofLogNotice("loadSphereCloud") << filename << ": " << cloud->size() << " spheres in "
+      << stats.references << " groups, " << stats.nodes << " nodes, depth " << stats.max_depth
+      << ", SAH cost " << stats.sah_cost << ", " << cloud->memoryUsage() << " bytes, built in " << build_ms << " ms";
+
+  auto to_world = Transform(translation(position[0], position[1], position[2]));
+  raytracer->addObject(std::make_shared<Instance>(cloud, to_world));
+  return true;
+}
+
+std::vector<std::shared_ptr<Model>> Scene::getMeshes() const
+{
+    std::vector<std::shared_ptr<Model>> models;
+    for (const auto& file: meshes){
+        models.insert(models.end(), file.second.begin(), file.second.end());
+    }
+    return models;
+}
+
+void Scene::updateMinMax(float x, float y, float z)
+{
+    min_x = std::min(min_x, x);
+    max_x = std::max(max_x, x);
+
+    min_y = std::min(min_y, y);
+    max_y = std::max(max_y, y);
+
+    min_z = std::min(min_z, z);
+    max_z = std::max(max_z, z);
+}
\ No newline at end of file
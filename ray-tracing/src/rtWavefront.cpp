@@ -0,0 +1,270 @@
+#include "rtWavefront.h"
+#include "rtRayTracer.h"
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+
+void RayQueue::reset(size_t capacity)
+{
+    if (item.size() < capacity){
+        for (int axis = 0; axis < 3; axis++){
+            o[axis].resize(capacity);
+            d[axis].resize(capacity);
+        }
+        t_max.resize(capacity);
+        item.resize(capacity);
+    }
+    count.store(0, std::memory_order_relaxed);
+}
+
+void RayQueue::getPacket(size_t first, int n, RayPacket& packet) const
+{
+    for (int axis = 0; axis < 3; axis++){
+        std::copy_n(&o[axis][first], n, packet.o[axis]);
+        std::copy_n(&d[axis][first], n, packet.d[axis]);
+    }
+    packet.size = n;
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+// body(begin, end) over [0, n), split into chunks of grain across the cores
+template<typename Body>
+static void for_range(size_t n, size_t grain, bool parallel, Body&& body)
+{
+    if (!parallel){
+        body(size_t(0), n);
+        return;
+    }
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n, grain), [&](const tbb::blocked_range<size_t>& range){
+        body(range.begin(), range.end());
+    });
+}
+
+Wavefront::Wavefront(const RayTracer& tracer): tracer(tracer)
+{
+    stats[GENERATE].name = "generate";
+    stats[EXTEND].name = "extend";
+    stats[SHADE].name = "shade";
+    stats[SHADOW].name = "shadow";
+}
+
+void Wavefront::resetStats()
+{
+    for (auto& stage: stats){
+        stage.rays = 0;
+        stage.seconds = 0.0;
+    }
+}
+
+template<typename Kernel>
+void Wavefront::runStage(Stage stage, size_t rays, Kernel&& kernel)
+{
+    auto t_start = Clock::now();
+    kernel();
+    stats[stage].rays += rays;
+    stats[stage].seconds += std::chrono::duration<double>(Clock::now() - t_start).count();
+}
+
+template<typename Handler>
+void Wavefront::extend(const RayQueue& queue, bool parallel, Handler&& hit)
+{
+    size_t n = queue.size();
+    size_t packets = (n + RayPacket::max_size - 1) / RayPacket::max_size;
+    runStage(EXTEND, n, [&]{
+        for_range(packets, 1, parallel, [&](size_t begin, size_t end){
+            RayPacket packet;
+            Intersection closest[RayPacket::max_size];
+            for (size_t p = begin; p < end; p++){
+                size_t first = p * RayPacket::max_size;
+                queue.getPacket(first, static_cast<int>(std::min<size_t>(RayPacket::max_size, n - first)), packet);
+                RayMask hits = tracer.testHit(packet, packet.all(), closest);
+                for (int k = 0; k < packet.size; k++){
+                    hit(queue.item[first + k], packet.ray(k), (hits >> k) & 1 ? &closest[k] : nullptr);
+                }
+            }
+        });
+    });
+}
+
+template<typename Handler>
+void Wavefront::traceShadows(const RayQueue& queue, bool parallel, Handler&& lit)
+{
+    size_t n = queue.size();
+    size_t packets = (n + RayPacket::max_size - 1) / RayPacket::max_size;
+    runStage(SHADOW, n, [&]{
+        for_range(packets, 1, parallel, [&](size_t begin, size_t end){
+            RayPacket packet;
+            for (size_t p = begin; p < end; p++){
+                size_t first = p * RayPacket::max_size;
+                queue.getPacket(first, static_cast<int>(std::min<size_t>(RayPacket::max_size, n - first)), packet);
+                RayMask blocked = tracer.occluded(packet, packet.all(), &queue.t_max[first]);
+                for (int k = 0; k < packet.size; k++) lit(queue.item[first + k], !((blocked >> k) & 1));
+            }
+        });
+    });
+}
+
+void Wavefront::renderSample(int sample, bool jitter, glm::vec4* colors, bool parallel, const std::atomic<bool>* cancel)
+{
+    // tile after tile and 8 x 8 block after block, so the packets of the
+    // primary and shadow rays hold square blocks of pixels as in getBlockColors
+    const int block = 8;
+    size_t n_pixels = static_cast<size_t>(tracer.width) * tracer.height;
+    if (pixel_order.size() != n_pixels){
+        pixel_order.clear();
+        for (const auto& tile: tracer.getTiles()){
+            for (int by = tile.y0; by < tile.y1; by += block){
+                for (int bx = tile.x0; bx < tile.x1; bx += block){
+                    for (int j = by; j < std::min(tile.y1, by + block); j++){
+                        for (int i = bx; i < std::min(tile.x1, bx + block); i++) pixel_order.push_back(j * tracer.width + i);
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t first = 0; first < n_pixels; first += wave_pixels){
+        if (cancel && *cancel) return;
+        renderWave(&pixel_order[first], std::min<size_t>(wave_pixels, n_pixels - first), sample, jitter, colors, parallel);
+    }
+}
+
+void Wavefront::renderWave(const unsigned* pixels, size_t count, int sample, bool jitter, glm::vec4* colors, bool parallel)
+{
+    const auto& lights = tracer.lights;
+    const auto& settings = tracer.settings;
+    const int reflection_rays = RayTracer::reflection_rays;
+    size_t n_lights = lights.size();
+    size_t pixel_rays = settings.reflections ? n_lights * reflection_rays : 0;
+
+    primary.reset(count);
+    shadow.reset(count * n_lights);
+    reflection.reset(count * pixel_rays);
+    reflection_shadow.reset(count * pixel_rays);
+    records.resize(count);
+    visible.resize(count * n_lights);
+    reflective.assign(count, 0);
+    reflect_records.resize(count * pixel_rays);
+    reflected.resize(count * pixel_rays);
+
+    auto start_sample = [&](size_t k){
+        return tracer.startSample(pixels[k] % tracer.width, pixels[k] / tracer.width, sample, jitter);
+    };
+
+    runStage(GENERATE, count, [&]{
+        size_t base = primary.reserve(count);
+        for_range(count, 256, parallel, [&](size_t begin, size_t end){
+            for (size_t k = begin; k < end; k++){
+                auto pos = start_sample(k);
+                auto ray = tracer.camera.rayForPixel(tracer.viewport.toU(pos[0], tracer.width),
+                    tracer.viewport.toV(pos[1], tracer.height));
+                primary.set(base + k, ray, INFINITY, static_cast<unsigned>(k));
+            }
+        });
+    });
+
+    extend(primary, parallel, [&](unsigned k, const Ray& ray, const Intersection* closest){
+        records[k] = closest ? closest->obj->getHitRecord(ray, *closest) : HitRecord();
+    });
+
+    // shadow rays toward every light, and the reflection rays drawn by the
+    // pixel's sampler right after its primary ray, as performShading does.
+    // Each chunk reserves the slots of all its shadow rays at once.
+    std::atomic<size_t> shaded{0};
+    runStage(SHADE, 0, [&]{
+        for_range(count, 64, parallel, [&](size_t begin, size_t end){
+            Ray rays[reflection_rays];
+            size_t chunk_hits = 0;
+            for (size_t k = begin; k < end; k++) chunk_hits += records[k].hit;
+            size_t slot = shadow.reserve(chunk_hits * n_lights);
+
+            for (size_t k = begin; k < end; k++){
+                const auto& record = records[k];
+                if (!record.hit) continue;
+
+                for (size_t l = 0; l < n_lights; l++){
+                    float t_max;
+                    auto ray = tracer.getShadowRay(record, *lights[l], t_max);
+                    shadow.set(slot++, ray, t_max, static_cast<unsigned>(k * n_lights + l));
+                }
+
+                if (pixel_rays && record.obj->isReflectEnabled()){
+                    reflective[k] = 1;
+                    start_sample(k);
+                    size_t first = reflection.reserve(pixel_rays);
+                    for (size_t l = 0; l < n_lights; l++){
+                        tracer.getReflectionRays(record, rays);
+                        for (int r = 0; r < reflection_rays; r++){
+                            size_t ray = l * reflection_rays + r;
+                            reflection.set(first + ray, rays[r], INFINITY, static_cast<unsigned>(k * pixel_rays + ray));
+                        }
+                    }
+                }
+            }
+            shaded += chunk_hits;
+        });
+    });
+
+    traceShadows(shadow, parallel, [&](unsigned item, bool lit){
+        visible[item] = lit;
+    });
+
+    if (reflection.size() > 0){
+        extend(reflection, parallel, [&](unsigned id, const Ray& ray, const Intersection* closest){
+            reflected[id] = glm::vec4(0,0,0,0);
+            if (!closest){
+                reflect_records[id].hit = false;
+                return;
+            }
+            reflect_records[id] = closest->obj->getHitRecord(ray, *closest);
+        });
+
+        runStage(SHADE, 0, [&]{
+            size_t n = reflection.size();
+            for_range(n, 256, parallel, [&](size_t begin, size_t end){
+                size_t chunk_hits = 0;
+                for (size_t s = begin; s < end; s++) chunk_hits += reflect_records[reflection.item[s]].hit;
+                size_t slot = reflection_shadow.reserve(chunk_hits);
+
+                for (size_t s = begin; s < end; s++){
+                    unsigned id = reflection.item[s];
+                    const auto& record = reflect_records[id];
+                    if (!record.hit) continue;
+
+                    float t_max;
+                    auto ray = tracer.getShadowRay(record, *lights[id % pixel_rays / reflection_rays], t_max);
+                    reflection_shadow.set(slot++, ray, t_max, id);
+                }
+                shaded += chunk_hits;
+            });
+        });
+
+        traceShadows(reflection_shadow, parallel, [&](unsigned id, bool lit){
+            reflected[id] = tracer.getReflectedColor(reflect_records[id], lights[id % pixel_rays / reflection_rays], &lit);
+        });
+    }
+
+    // the reflections toward every light come first and the shaded color of
+    // the object is added on top, as in performShading
+    runStage(SHADE, 0, [&]{
+        for_range(count, 64, parallel, [&](size_t begin, size_t end){
+            std::unique_ptr<bool[]> lit(new bool[n_lights]);
+            for (size_t k = begin; k < end; k++){
+                glm::vec4 color(0,0,0,0);
+                if (records[k].hit){
+                    if (reflective[k]){
+                        for (size_t l = 0; l < n_lights; l++){
+                            color = add_vecs(color, tracer.averageReflections(&reflected[k * pixel_rays + l * reflection_rays]));
+                        }
+                    }
+                    for (size_t l = 0; l < n_lights; l++) lit[l] = visible[k * n_lights + l];
+                    color = add_vecs(color, tracer.getObjectColor(records[k], lit.get()));
+                    color = clamp(color, 0.0, 1.0);
+                }
+                else color[3] += 1.f;
+                colors[pixels[k]] = color;
+            }
+        });
+    });
+    stats[SHADE].rays += shaded;
+}